@@ -12,614 +12,4543 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <time.h>
+#include <strings.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <signal.h>
+#include <linux/uinput.h>
+#include <linux/uhid.h>
+#include <dirent.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/XTest.h>
 #include <wayland-client-core.h>
 #include "macros.h"
+#include "keymap.h"
+
+#define MAX_CHORD_KEYS 8
+#define PACKET_SIZE 40
+#define KEYCODE_RANGE 1024 // Keycodes produced by the decoders are below this
+#define TRANSFER_COUNT 4 // Interrupt transfers kept in flight
+#define PACKET_QUEUE 64 // Completed packets waiting to be processed
+#define COMMAND_QUEUE 32 // Command requests waiting for the executor
+#define MAX_CHILDREN 32 // Commands running at the same time
+#define WHEEL_MAX_REPEAT 32 // Most wheel taps sent in one batch
+#define WHEEL_BASE_RATE 10.0 // Ticks per second below which the wheel is not accelerated
+#define MAX_BUTTONS 64
+#define MAX_WHEELS 256
+#define MAX_CHORDS 64
+#define MAX_HELD 8 // Keys and mouse buttons a device can hold down at once
+#define CONTROL_BUTTON (1u << 31) // Stands for the button tapped from the control socket
+#define ARENA_BLOCK 4096
+#define CACHE_MAGIC "KDCC" // Compiled config files
+#define CACHE_VERSION 4
+#define RELOAD_DELAY 50 // Milliseconds of quiet before a changed config is reloaded
+#define RETRY_MIN 1000 // Milliseconds before a device that failed is opened again, doubled every failure
+#define RETRY_MAX 32000
+#define MAX_SOURCES 32 // File descriptors watched by the event loop
+#define LATENCY_BUCKETS 22 // Powers of two microseconds, the last one collects the rest
+#define MAX_SYNTHETIC 8 // Synthetic devices given with -synthetic
+#define SOAK_TOLERANCE 1024 // KiB resident memory may grow by during a soak test
+#define MAX_GRABS 4 // evdev nodes grabbed per device read through hidraw
+#define UHID_REPORT 8 // Bytes in the reports of virtual devices made with -uhid
+#ifndef HIDRAW_SYSFS // Can be pointed at a fake tree for testing
+#define HIDRAW_SYSFS "/sys/class/hidraw"
+#endif
+#ifndef HIDRAW_DEV
+#define HIDRAW_DEV "/dev"
+#endif
+#define CAPTURE_MAGIC "KDRC" // Packet captures
+#define CAPTURE_VERSION 1
+#define TRACE_MAGIC "KDTR" // Shared memory trace rings
+#define TRACE_VERSION 1
+#define TRACE_RECORDS 4096 // Packets kept in the trace ring
+#define MAX_CLIENTS 8 // Connections to the control socket
+#define CONTROL_LINE 256 // Longest control request
+#define MAX_MACRO_STEPS 64
+#define MAX_MACROS 16 // Macros playing at the same time
+#define INJECT_EVENTS 1024 // uinput events collected before they have to be written
+#define PREFAULT_STACK (64*1024) // Stack touched up front by the low latency mode so it is not faulted in later
 
 char* file = "default.cfg";
 
+extern char **environ;
+
+typedef struct keychord keychord;
+typedef struct action action;
+typedef struct config config;
+typedef struct arenaBlock arenaBlock;
+typedef struct cacheHeader cacheHeader;
 typedef struct event event;
 typedef struct wheel wheel;
 typedef struct modelInfo modelInfo;
+typedef struct packet packet;
+typedef struct transferRing transferRing;
+typedef struct configSlot configSlot;
+typedef struct keydial keydial;
+typedef struct loopSource loopSource;
+typedef struct transport transport;
+typedef struct synthDevice synthDevice;
+typedef struct captureHeader captureHeader;
+typedef struct profile profile;
+typedef struct captureRecord captureRecord;
+typedef struct macroStep macroStep;
+typedef struct traceHeader traceHeader;
+typedef struct traceRecord traceRecord;
 
 typedef enum displayserver {
   X11,
   WAYLAND,
+  MOCK, // Counts events instead of sending them, for benchmarks
   NONE
 } displayserver;
 
+typedef enum actionType {
+	ACTION_UNSET, // Button is not in the config file
+	ACTION_NONE, // "NULL", releases whatever is held
+	ACTION_KEY,
+	ACTION_MOUSE,
+	ACTION_SWAP,
+	ACTION_COMMAND,
+	ACTION_MACRO
+} actionType;
+
+// What to do when a command button is pressed while its command is still running
+typedef enum commandPolicy {
+	POLICY_DROP, // Ignore the press
+	POLICY_COALESCE, // Run once more after it exits, however many presses came in
+	POLICY_QUEUE // Run once more for every press
+} commandPolicy;
+
 typedef enum boardModel {
 	KD100,
 	K20
 } boardModel;
 
+struct keychord{
+	int count;
+	unsigned int generation; // Keymap generation the keycodes were resolved against
+	KeySym syms[MAX_CHORD_KEYS];
+	int xcount; // X keycodes, with a Shift added for keysyms on the shifted level
+	KeyCode codes[MAX_CHORD_KEYS+1];
+	int evcount; // Linux input event codes for the uinput backend (may include an added shift)
+	unsigned short evcodes[MAX_CHORD_KEYS+1];
+};
+
+// A config function compiled once at load time so dispatching needs no string work
+struct action{
+	actionType type;
+	char* function; // Text from the config file
+	keychord keys; // ACTION_KEY
+	int button; // ACTION_MOUSE (1-5)
+	char* argv[4]; // ACTION_COMMAND
+	macroStep* steps; // ACTION_MACRO
+	int totalSteps;
+	commandPolicy policy;
+	int running; // Owned by the executor thread
+	int pending;
+	config* owner;
+};
+
+// A key tap or mouse click, or a pause when act.type is ACTION_UNSET
+struct macroStep {
+	action act;
+	int delay; // Milliseconds
+};
+
 struct event{
 	int type;
-	char* function;
+	commandPolicy policy;
+	uint32_t chord; // Buttons that trigger a chord binding, bit i is button i
+	action act;
 };
 
 struct wheel {
-	char* right;
-	char* left;
+	action right;
+	action left;
+};
+
+struct arenaBlock {
+	arenaBlock* next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+// A loaded config file; the tables and strings all live in the arena
+struct config {
+	event* events;
+	int totalButtons;
+	wheel* wheelEvents;
+	int totalWheels;
+	event* chords;
+	int totalChords;
+	int wheelWindow; // Milliseconds to collect wheel ticks for before sending them
+	double wheelAcceleration; // 0 disables acceleration
+	atomic_int users; // Commands queued or running from this config
+	config* next; // Retired configs waiting to be freed
+	arenaBlock* arena;
+	profile* profiles; // Configs used instead of this one while an application has focus
+	int totalProfiles;
+};
+
+struct profile {
+	char* wmclass; // Matched against the class and the instance name of the focused window
+	char* file;
+	config* cfg; // Owned by the config that lists the profile
+};
+
+struct cacheHeader {
+	char magic[4];
+	uint32_t version;
+	int64_t mtime;
+	int64_t mtimeNsec;
+	int64_t size;
+	uint64_t hash; // Of the config file contents
+	int32_t totalButtons;
+	int32_t totalWheels;
+	int32_t wheelWindow;
+	double wheelAcceleration;
+	int32_t totalProfiles;
+	int32_t totalChords;
 };
 
 struct modelInfo {
+	char* name; // Also names the model's own config file (<name>.cfg)
 	int productId;
 	int vendorId;
 	int port;
 	int keycodes[21];
 	boardModel modell;
+	int (*decode)(unsigned char*); // Converts a packet to a keycode
+	bool (*state)(unsigned char*, uint32_t*); // Buttons down in a packet, false when it carries none (wheel packets)
+	void (*encode)(int, unsigned char*); // Builds a packet that decodes to a keycode
+	signed char buttons[KEYCODE_RANGE]; // Keycode to button index, built at startup
+	configSlot* slot; // Config used by devices of this model
+};
+
+int decodeKD100(unsigned char*);
+int decodeK20(unsigned char*);
+bool stateKD100(unsigned char*, uint32_t*);
+bool stateK20(unsigned char*, uint32_t*);
+void encodeKD100(int, unsigned char*);
+void encodeK20(int, unsigned char*);
+
+// A packet and what it means, decoded when it is queued
+struct packet {
+	unsigned char data[PACKET_SIZE]; // The last packet when several were merged
+	int length;
+	struct timespec time; // Completion time of the transfer (CLOCK_MONOTONIC)
+	uint32_t pressed; // Buttons held down
+	uint32_t rose; // Buttons that went down in this packet or in one merged into it, so taps survive a merge
+	bool buttons; // pressed is set; wheel packets carry no button state
+	unsigned short wheel[2]; // Clockwise and counter clockwise ticks
+};
+
+// Single producer (the thread completing the transfers), single consumer (the event loop)
+struct transferRing {
+	struct libusb_transfer* transfers[TRANSFER_COUNT];
+	unsigned char buffers[TRANSFER_COUNT][PACKET_SIZE]; // Owned by the ring, libusb only borrows them
+	modelInfo* model; // Decodes the packets
+	uint8_t captureId; // Tells devices of the same model apart in captures
+	packet packets[PACKET_QUEUE];
+	atomic_int head, tail;
+	atomic_int inFlight;
+	atomic_int err; // First fatal transfer error
+	bool merging; // Producer only: packets[head] collects what arrives while the ring is full
+	uint32_t pressed; // Producer only: buttons down in the last packet that had button state
+	unsigned long received, merged, overruns;
+};
+
+typedef struct wheelBatch {
+	action* act; // Function the pending ticks belong to
+	int count;
+	struct timespec first; // Time of the first pending tick
+	struct timespec last; // Time of the previous tick, for measuring the rate
+	double rate; // Smoothed ticks per second
+} wheelBatch;
+
+typedef struct histogram {
+	unsigned long buckets[LATENCY_BUCKETS]; // Bucket i counts latencies below 2^i us
+	unsigned long count;
+	long total, max; // Microseconds
+} histogram;
+
+#define STATS_WHEEL (ACTION_MACRO+1) // Wheel batches are counted apart from buttons
+
+// Latencies from USB transfer completion to dispatch to finished injection
+struct {
+	bool enabled;
+	histogram queue; // Transfer completed -> packet dispatched
+	histogram inject; // Packet dispatched -> Handler returned
+	histogram total; // Transfer completed -> Handler returned
+	unsigned long actions[STATS_WHEEL+1]; // Injections per action type
+	long actionUs[STATS_WHEEL+1]; // Time spent injecting them
+	unsigned long packets;
+	unsigned long allocations; // Made by keydialDispatch, with COUNT_ALLOCATIONS
+} stats;
+
+char* statsNames[STATS_WHEEL+1] = {"unset", "none", "key", "mouse", "swap", "command", "macro", "wheel"};
+
+// An opened device and everything the event loop keeps for it
+struct keydial {
+	libusb_device* dev;
+	libusb_device_handle* handle;
+	modelInfo* model;
+	int interfaces;
+	transferRing ring;
+	config* cfg; // Config of the device's model
+	config* active; // cfg or the profile of the focused application; the state below belongs to it
+	unsigned int focusGeneration;
+	uint32_t pressed; // Buttons down in the last packet
+	struct {
+		action* act; // Key or mouse button held down
+		uint32_t buttons; // Released when any of these is
+	} held[MAX_HELD];
+	int heldCount;
+	int wheelFunction;
+	wheelBatch batch; // Wheel ticks waiting to be sent
+	transport* transport; // Where the packets come from
+	synthDevice* synth;
+	struct {
+		int fd; // /dev/hidrawN
+		char name[16];
+		int grabs[MAX_GRABS]; // evdev nodes of the device, so the kernel's own key events don't reach the desktop
+		int grabCount;
+	} hidraw;
+	keydial* next;
+};
+
+struct captureHeader {
+	char magic[4];
+	uint32_t version;
+};
+
+// Followed by length bytes of packet data
+struct captureRecord {
+	int64_t time; // CLOCK_MONOTONIC in nanoseconds
+	uint8_t model; // Index in models[]
+	uint8_t device;
+	uint8_t length;
+	uint8_t reserved[5];
+};
+
+// Start of the shared memory written with -trace, followed by the records
+struct traceHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t records;
+	uint32_t recordSize;
+	_Atomic uint64_t head; // Records written so far
+};
+
+// One dispatched packet
+struct traceRecord {
+	_Atomic uint64_t seq; // Odd while the record is being written, 2 * (index + 1) once it is done
+	int64_t time; // Completion time of the transfer, CLOCK_MONOTONIC in nanoseconds
+	int32_t duration; // Nanoseconds spent dispatching the packet
+	uint32_t pressed; // Buttons down after it
+	int16_t keycode;
+	int8_t action; // Action type sent, -1 for none
+	uint8_t model; // Index in models[]
+	uint8_t device;
+	uint8_t length;
+	uint16_t wheel[2];
+	unsigned char data[PACKET_SIZE];
+};
+
+// A source of keydials and their packets
+struct transport {
+	char* name;
+	bool (*start)(int debug); // Adds its file descriptors to the event loop
+	int (*update)(int accept, int debug); // Opens new devices, returns how long the loop may sleep (-1 for ever)
+	void (*close)(keydial* kd, int debug);
+	void (*stop)();
+};
+
+// Generates the packets of a keydial being used, for testing without the hardware
+struct synthDevice {
+	modelInfo* model;
+	int rate; // Packets per second, 0 for as fast as they are processed
+	long count; // Packets to send before disconnecting
+	int wheel; // Percentage of presses that are wheel ticks
+	long sent;
+	int fd; // timerfd, or an eventfd that is never read when there is no rate
+	bool release; // The next packet releases the last button
+	unsigned int seed;
+	struct timespec start;
+};
+
+// A config file and the config currently loaded from it
+struct configSlot {
+	char name[PATH_MAX]; // File looked up by findConfigfile
+	config* current; // Only touched by the event loop
+	_Atomic(config*) pending; // Reloaded config waiting to be picked up
+	bool used;
+};
+
+typedef void (*sourceHandler)(int fd, uint32_t events, void* data);
+
+struct loopSource {
+	int fd;
+	sourceHandler handler; // NULL when the entry is free
+	void* data;
 };
 
 modelInfo models[2] = {{ // KD100
+	.name = "KD100",
 	.vendorId = 0x256c,
 	.productId = 0x006d,
 	.port = 0x81,
 	.keycodes = {1, 2, 4, 8, 16, 32, 64, 128, 129, 130, 132, 136, 144, 160, 192, 256, 257, 258, 260, 641, 642},
-	.modell = KD100
+	.modell = KD100,
+	.decode = decodeKD100,
+	.state = stateKD100,
+	.encode = encodeKD100
 },{ // K20 KeyDial
+	.name = "K20",
 	.vendorId = 0x256c,
 	.productId = 0x0069,
 	.port = 0x82,
 	.keycodes = {14, 10, 15, 76, 12, 7, 5, 8, 22, 29, 6, 25, 1, 4, 2, 40, 44, 17, -1, -1, -1},
-	.modell = K20
+	.modell = K20,
+	.decode = decodeK20,
+	.state = stateK20,
+	.encode = encodeK20
 }};
 
 void GetDevice(int, int, int, libusb_context *ctx);
-void Handler(char*, int);
-void HandlerX11(char*, int);
-void HandlerWayland(char*, int);
-char* Substring(char*, int, int);
+void Handler(action*, int);
+void HandlerRepeat(action*, int);
+void HandlerX11(action*, int, int);
+void HandlerXTest(action*, int, int);
+void HandlerXdotool(action*, int, int);
+void HandlerWayland(action*, int, int);
+void parseKeychord(keychord*, char*);
+void x11ResolveKeychord(keychord*);
+void x11Queued();
+void injectBegin();
+void injectCommit();
+void injectReleaseAll();
+void captureWrite(transferRing*, unsigned char*, int, struct timespec*);
+bool focusStart(int);
+void focusStop();
+void uinputResolveKeychord(keychord*);
+const keysymMap* uinputKeysym(KeySym);
+void signalEvents(int, uint32_t, void*);
+bool loopAdd(int, uint32_t, sourceHandler, void*);
 
 displayserver getWindowSystem();
 
-displayserver windowsystem = NONE;
-modelInfo model;
+displayserver windowsystem = NONE;
+
+Display* display = NULL; // Persistent X connection used by the XTest backend
+bool xdotool = false; // Inject events through xdotool instead of XTest
+unsigned int keymapGeneration = 1; // Bumped on MappingNotify so cached keycodes get refreshed
+
+char* uinputPath = "/dev/uinput";
+int uinputKeyboard = -1; // Virtual devices used by the Wayland backend
+int uinputMouse = -1;
+
+FILE* captureFile = NULL; // -record
+
+libusb_hotplug_callback_handle hotplugHandles[array_size(models)];
+atomic_int hotplugArrived = 0; // Set by the hotplug callback when a supported device is plugged in
+keydial* keydials = NULL; // Devices being read
+pthread_mutex_t keydialsLock = PTHREAD_MUTEX_INITIALIZER; // Held while the list changes, the hotplug callback can run on the reader thread
+
+// -lowlatency: USB transfers are completed on a thread of their own
+struct {
+	bool enabled;
+	int priority; // SCHED_FIFO priority of the reader, 0 keeps the normal scheduler
+	int cpu; // CPU the reader is pinned to, -1 for any
+	bool started;
+	pthread_t thread;
+	int stop; // Read by libusb under its event lock
+	int wake; // eventfd that tells the event loop packets arrived
+	atomic_bool pending; // Something completed since the event loop was last woken
+	unsigned long allocations;
+} reader = {.cpu = -1, .wake = -1};
+
+#ifdef COUNT_ALLOCATIONS
+// Counts heap allocations per thread to check that dispatching makes none
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+_Thread_local unsigned long threadAllocations = 0;
+
+void* malloc(size_t size){
+	threadAllocations++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size){
+	threadAllocations++;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size){
+	threadAllocations++;
+	return __libc_realloc(ptr, size);
+}
+
+unsigned long allocationCount(){
+	return threadAllocations;
+}
+#else
+unsigned long allocationCount(){
+	return 0;
+}
+#endif
+
+bool useConfigCache = false; // Load and save compiled configs
+
+// Time taken by each step until the first device is running, with -startup
+struct {
+	bool enabled;
+	struct timespec begin, last;
+} startup;
+
+// One slot per model with its own config file, plus the one shared by the rest
+configSlot configSlots[array_size(models)+1];
+_Atomic(config*) retiredConfigs = NULL; // Configs the event loop is done with
+
+// Fills in what depends on the running backend, for parsed and cached actions alike
+void linkAction(action* act){
+	if (act->type == ACTION_KEY){
+		if (display){
+			x11ResolveKeychord(&act->keys);
+			for (int i = 0; i < act->keys.count; i++)
+				if (XKeysymToKeycode(display, act->keys.syms[i]) == 0)
+					printf("Warning: no key types %s with the current keyboard layout, it is left out\n", XKeysymToString(act->keys.syms[i]));
+		}
+		if (windowsystem == WAYLAND){
+			uinputResolveKeychord(&act->keys);
+			for (int i = 0; i < act->keys.count; i++)
+				if (uinputKeysym(act->keys.syms[i]) == NULL)
+					printf("Warning: no key types %s with the uinput keymap, it is left out\n", XKeysymToString(act->keys.syms[i]));
+		}
+	}else if (act->type == ACTION_COMMAND){
+		act->argv[0] = "/bin/sh";
+		act->argv[1] = "-c";
+		act->argv[2] = act->function;
+		act->argv[3] = NULL;
+	}
+}
+
+char* arenaAlloc(arenaBlock**, size_t);
+char* arenaStrndup(arenaBlock**, char*, size_t);
+
+// Splits "ctrl+c, delay 100, mouse1" into steps, parsed once like any other action
+void compileMacro(action* act, arenaBlock** arena){
+	macroStep steps[MAX_MACRO_STEPS];
+	int count = 0;
+	char* step = act->function;
+
+	while (*step != '\0' && count < MAX_MACRO_STEPS){
+		while (*step == ' ' || *step == '\t')
+			step++;
+		size_t length = strcspn(step, ",");
+		size_t end = length;
+		while (end > 0 && (step[end-1] == ' ' || step[end-1] == '\t' || step[end-1] == '\r'))
+			end--;
+		if (end > 0){
+			macroStep* s = &steps[count++];
+			memset(s, 0, sizeof(macroStep));
+			s->act.function = arenaStrndup(arena, step, end);
+			if (strncmp(s->act.function, "delay", 5) == 0 && (s->act.function[5] == ' ' || s->act.function[5] == '\t')){
+				s->act.type = ACTION_UNSET;
+				s->delay = atoi(s->act.function + 6);
+				if (s->delay < 0)
+					s->delay = 0;
+			}else if (strncmp(s->act.function, "mouse", 5) == 0 && s->act.function[5] >= '1' && s->act.function[5] <= '5' && s->act.function[6] == '\0'){
+				s->act.type = ACTION_MOUSE;
+				s->act.button = s->act.function[5] - '0';
+			}else{
+				s->act.type = ACTION_KEY;
+				parseKeychord(&s->act.keys, s->act.function);
+				linkAction(&s->act);
+			}
+		}
+		step += length;
+		if (*step == ',')
+			step++;
+	}
+	act->totalSteps = count;
+	act->steps = (macroStep*)arenaAlloc(arena, count * sizeof(macroStep));
+	if (count)
+		memcpy(act->steps, steps, count * sizeof(macroStep));
+}
+
+void compileAction(action* act, int type, arenaBlock** arena){
+	char* function = act->function;
+
+	memset(act, 0, sizeof(action));
+	act->function = function;
+	if (function == NULL){
+		act->type = ACTION_UNSET;
+	}else if (strcmp(function, "NULL") == 0){
+		act->type = ACTION_NONE;
+	}else if (type == 3){
+		act->type = ACTION_MACRO;
+		compileMacro(act, arena);
+	}else if (type == 0){
+		act->type = ACTION_KEY;
+		parseKeychord(&act->keys, function);
+	}else if (strcmp(function, "swap") == 0){
+		act->type = ACTION_SWAP;
+	}else if (strncmp(function, "mouse", 5) == 0 && function[5] >= '1' && function[5] <= '5' && function[6] == '\0'){
+		act->type = ACTION_MOUSE;
+		act->button = function[5] - '0';
+	}else{
+		act->type = ACTION_COMMAND;
+	}
+	linkAction(act);
+}
+
+char* arenaAlloc(arenaBlock** arena, size_t size){
+	size = (size + 7) & ~(size_t)7;
+	if (*arena == NULL || (*arena)->used + size > (*arena)->size){
+		size_t blockSize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+		arenaBlock* block = malloc(sizeof(arenaBlock) + blockSize);
+		if (block == NULL)
+			return NULL;
+		block->next = *arena;
+		block->size = blockSize;
+		block->used = 0;
+		*arena = block;
+	}
+	char* out = (*arena)->data + (*arena)->used;
+	(*arena)->used += size;
+	return out;
+}
+
+char* arenaStrndup(arenaBlock** arena, char* in, size_t length){
+	char* out = arenaAlloc(arena, length + 1);
+	memcpy(out, in, length);
+	out[length] = '\0';
+	return out;
+}
+
+void arenaFree(arenaBlock* arena){
+	while (arena){
+		arenaBlock* next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
+// Commands take their references on the owner, profiles are owned by the config that lists them
+void configAdopt(config* cfg, config* owner){
+	for (int i = 0; i < cfg->totalButtons; i++)
+		cfg->events[i].act.owner = owner;
+	for (int i = 0; i < cfg->totalChords; i++)
+		cfg->chords[i].act.owner = owner;
+	for (int i = 0; i < cfg->totalWheels; i++){
+		cfg->wheelEvents[i].right.owner = owner;
+		cfg->wheelEvents[i].left.owner = owner;
+	}
+}
+
+void configFree(config* cfg){
+	// Everything the config points to lives in its arena
+	if (cfg == NULL)
+		return;
+	for (int i = 0; i < cfg->totalProfiles; i++)
+		configFree(cfg->profiles[i].cfg);
+	arenaFree(cfg->arena);
+}
+
+bool findConfigfile(char* name, char* path, size_t size, bool report){
+	char* home = getpwuid(getuid())->pw_dir;
+
+	if (access(name, R_OK) == 0){
+		snprintf(path, size, "%s", name);
+		return true;
+	}
+	snprintf(path, size, "%s/.config/KD100/%s", home, name);
+	if (access(path, R_OK) == 0)
+		return true;
+
+	if (!report){
+		return false;
+	}else if (strcmp(name, "default.cfg")){
+		printf("CONFIG FILE NOT FOUND\n");
+	}else{
+		printf("DEFAULT CONFIGS ARE MISSING!\n");
+		printf("Please add default.cfg to %s/.config/KD100/ or specify a file to use with -c\n", home);
+	}
+	return false;
+}
+
+// Returns the text after a keyword with surrounding whitespace removed
+char* configValue(char* line, size_t length, size_t start, size_t* valueLength){
+	while (start < length && (line[start] == ' ' || line[start] == '\t'))
+		start++;
+	size_t end = length;
+	while (end > start && (line[end-1] == ' ' || line[end-1] == '\t' || line[end-1] == '\r'))
+		end--;
+	*valueLength = end - start;
+	return line + start;
+}
+
+bool configKeyword(char* line, size_t length, size_t i, char* keyword, size_t keywordLength){
+	return i + keywordLength <= length && memcmp(line + i, keyword, keywordLength) == 0;
+}
+
+config* parseConfigfile(char* text, size_t textLength, char* path){
+	int button=-1, totalButtons=0, wheelType=0, leftWheels=0, rightWheels=0;
+	int buttonSpace=0, wheelSpace=0, totalChords=0;
+	bool chord = false; // button indexes chords instead of events
+	event* events = NULL; // Grown while parsing, copied into the arena at the end
+	event* chords = NULL;
+	wheel* wheelEvents = NULL;
+	profile* profiles = NULL;
+	int totalProfiles = 0;
+	arenaBlock* arena = NULL;
+	int lineNumber = 0;
+	config settings = {0};
+
+	// Each line is scanned once; the first keyword found decides what the line means
+	for (char* line = text; line < text + textLength; ){
+		char* newline = memchr(line, '\n', text + textLength - line);
+		size_t length = newline ? newline - line : text + textLength - line;
+		event* current = button == -1 ? NULL : chord ? &chords[button] : &events[button];
+		lineNumber++;
+		for (size_t i = 0; i < length; i++){
+			size_t valueLength;
+			char* value;
+			char c = line[i];
+			if (c != 't' && c != 'p' && c != 'B' && c != 'C' && c != 'f' && c != 'w' && c != 'W')
+				continue;
+
+			if (configKeyword(line, length, i, "type:", 5)){
+				value = configValue(line, length, i+5, &valueLength);
+				if (current)
+					current->type = atoi(value);
+				break;
+			}else if (configKeyword(line, length, i, "profile:", 8)){
+				value = configValue(line, length, i+8, &valueLength);
+				size_t classLength = 0;
+				while (classLength < valueLength && value[classLength] != ' ' && value[classLength] != '\t')
+					classLength++;
+				size_t fileLength;
+				char* fileName = configValue(value, valueLength, classLength, &fileLength);
+				if (classLength == 0 || fileLength == 0){
+					printf("%s:%d:%zu: expected a window class and a config file\n", path, lineNumber, i+1);
+					break;
+				}
+				profiles = realloc(profiles, (totalProfiles + 1) * sizeof(profile));
+				profiles[totalProfiles].wmclass = arenaStrndup(&arena, value, classLength);
+				profiles[totalProfiles].file = arenaStrndup(&arena, fileName, fileLength);
+				profiles[totalProfiles].cfg = NULL;
+				totalProfiles++;
+				break;
+			}else if (configKeyword(line, length, i, "policy:", 7)){
+				value = configValue(line, length, i+7, &valueLength);
+				if (current == NULL){
+					// Keywords outside of a button are comments
+				}else if (valueLength == 8 && memcmp(value, "coalesce", 8) == 0){
+					current->policy = POLICY_COALESCE;
+				}else if (valueLength == 5 && memcmp(value, "queue", 5) == 0){
+					current->policy = POLICY_QUEUE;
+				}else{
+					if (valueLength != 4 || memcmp(value, "drop", 4) != 0)
+						printf("%s:%d:%zu: unknown policy, using drop\n", path, lineNumber, (size_t)(value - line)+1);
+					current->policy = POLICY_DROP;
+				}
+				break;
+			}else if (configKeyword(line, length, i, "Chord", 5)){
+				// Buttons joined with '+', the chord fires when the last of them goes down
+				value = configValue(line, length, i+5, &valueLength);
+				uint32_t mask = 0;
+				int count = 0;
+				char* end = value;
+				while (end < value + valueLength){
+					char* next;
+					long number = strtol(end, &next, 10);
+					if (next == end || number < 0 || number >= 31)
+						break;
+					mask |= 1u << number;
+					count++;
+					end = next;
+					while (end < value + valueLength && (*end == ' ' || *end == '\t'))
+						end++;
+					if (end < value + valueLength && *end != '+')
+						break;
+					if (end < value + valueLength)
+						end++;
+				}
+				button = -1;
+				if (end != value + valueLength || count < 2 || totalChords == MAX_CHORDS){
+					printf("%s:%d:%zu: invalid chord, expected buttons below 31 joined with '+'\n", path, lineNumber, (size_t)(value - line)+1);
+					break;
+				}
+				chords = realloc(chords, (totalChords + 1) * sizeof(event));
+				memset(&chords[totalChords], 0, sizeof(event));
+				chords[totalChords].chord = mask;
+				button = totalChords++;
+				chord = true;
+				break;
+			}else if (configKeyword(line, length, i, "Button", 6)){
+				value = configValue(line, length, i+6, &valueLength);
+				char* end;
+				long number = strtol(value, &end, 10);
+				if (end == value || number < 0 || number >= MAX_BUTTONS){
+					printf("%s:%d:%zu: invalid button number\n", path, lineNumber, (size_t)(value - line)+1);
+					button = -1;
+					break;
+				}
+				button = number;
+				chord = false;
+				if (button >= buttonSpace){
+					buttonSpace = button + 1;
+					events = realloc(events, buttonSpace * sizeof(event));
+				}
+				if (button >= totalButtons){
+					memset(&events[totalButtons], 0, (button + 1 - totalButtons) * sizeof(event));
+					totalButtons = button + 1;
+				}
+				break;
+			}else if (configKeyword(line, length, i, "function:", 9)){
+				value = configValue(line, length, i+9, &valueLength);
+				if (button == -1)
+					break;
+				char* function = arenaStrndup(&arena, value, valueLength);
+				if (!wheelType){
+					current->act.function = function;
+				}else if (wheelType <= 2){
+					int* count = wheelType == 1 ? &rightWheels : &leftWheels;
+					int other = wheelType == 1 ? leftWheels : rightWheels;
+					if (*count >= wheelSpace){
+						wheelSpace = wheelSpace ? wheelSpace * 2 : 4;
+						wheelEvents = realloc(wheelEvents, wheelSpace * sizeof(wheel));
+					}
+					if (*count >= other){
+						wheelEvents[*count].right.function = "NULL";
+						wheelEvents[*count].left.function = "NULL";
+					}
+					if (wheelType == 1)
+						wheelEvents[*count].right.function = function;
+					else
+						wheelEvents[*count].left.function = function;
+					(*count)++;
+				}else{
+					printf("%s:%d:%zu: only two wheel directions can be defined, ignoring\n", path, lineNumber, i+1);
+				}
+				break;
+			}else if (configKeyword(line, length, i, "wheel_window:", 13)){
+				value = configValue(line, length, i+13, &valueLength);
+				settings.wheelWindow = atoi(value);
+				break;
+			}else if (configKeyword(line, length, i, "wheel_acceleration:", 19)){
+				value = configValue(line, length, i+19, &valueLength);
+				settings.wheelAcceleration = atof(value);
+				break;
+			}else if (configKeyword(line, length, i, "Wheel ", 6)){
+				wheelType++;
+				break;
+			}
+		}
+		line += length + 1;
+	}
+
+	// Move the tables into the arena so the whole config is freed as a unit
+	config* cfg = (config*)arenaAlloc(&arena, sizeof(config));
+	*cfg = settings;
+	cfg->totalButtons = totalButtons;
+	cfg->totalWheels = rightWheels > leftWheels ? rightWheels : leftWheels;
+	cfg->events = (event*)arenaAlloc(&arena, totalButtons * sizeof(event));
+	cfg->wheelEvents = (wheel*)arenaAlloc(&arena, cfg->totalWheels * sizeof(wheel));
+	if (totalButtons)
+		memcpy(cfg->events, events, totalButtons * sizeof(event));
+	cfg->totalChords = totalChords;
+	cfg->chords = (event*)arenaAlloc(&arena, totalChords * sizeof(event));
+	if (totalChords)
+		memcpy(cfg->chords, chords, totalChords * sizeof(event));
+	if (cfg->totalWheels)
+		memcpy(cfg->wheelEvents, wheelEvents, cfg->totalWheels * sizeof(wheel));
+	cfg->totalProfiles = totalProfiles;
+	cfg->profiles = (profile*)arenaAlloc(&arena, totalProfiles * sizeof(profile));
+	if (totalProfiles)
+		memcpy(cfg->profiles, profiles, totalProfiles * sizeof(profile));
+	free(events);
+	free(chords);
+	free(wheelEvents);
+	free(profiles);
+	cfg->arena = arena;
+
+	for (int i = 0; i < cfg->totalButtons; i++){
+		compileAction(&cfg->events[i].act, cfg->events[i].type, &cfg->arena);
+		cfg->events[i].act.policy = cfg->events[i].policy;
+	}
+	for (int i = 0; i < cfg->totalChords; i++){
+		compileAction(&cfg->chords[i].act, cfg->chords[i].type, &cfg->arena);
+		cfg->chords[i].act.policy = cfg->chords[i].policy;
+	}
+	for (int i = 0; i < cfg->totalWheels; i++){
+		compileAction(&cfg->wheelEvents[i].right, 0, &cfg->arena);
+		compileAction(&cfg->wheelEvents[i].left, 0, &cfg->arena);
+	}
+	configAdopt(cfg, cfg);
+	return cfg;
+}
+
+uint64_t hashBytes(char* data, size_t length){
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a
+	for (size_t i = 0; i < length; i++){
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// ~/.cache/KD100, created when missing
+void cacheDir(char* dir, size_t size){
+	char* base = getenv("XDG_CACHE_HOME");
+	if (base && base[0])
+		snprintf(dir, size, "%s/KD100", base);
+	else
+		snprintf(dir, size, "%s/.cache/KD100", getpwuid(getuid())->pw_dir);
+	if (mkdir(dir, 0755) < 0 && errno == ENOENT){
+		// ~/.cache might not exist yet either
+		char parent[PATH_MAX];
+		snprintf(parent, sizeof(parent), "%s", dir);
+		*strrchr(parent, '/') = '\0';
+		mkdir(parent, 0755);
+		mkdir(dir, 0755);
+	}
+}
+
+bool configCachePath(char* configPath, char* out, size_t size){
+	char dir[PATH_MAX];
+	cacheDir(dir, sizeof(dir));
+
+	char full[PATH_MAX];
+	if (realpath(configPath, full) == NULL)
+		return false;
+	return snprintf(out, size, "%s/%016llx.bin", dir, (unsigned long long)hashBytes(full, strlen(full))) < size;
+}
+
+void writeCacheString(FILE* f, char* string){
+	int32_t length = string ? strlen(string) : -1;
+	fwrite(&length, sizeof(length), 1, f);
+	if (length > 0)
+		fwrite(string, length, 1, f);
+}
+
+bool readCacheString(FILE* f, char** string, arenaBlock** arena){
+	int32_t length;
+	*string = NULL;
+	if (fread(&length, sizeof(length), 1, f) != 1 || length > 4096)
+		return false;
+	if (length >= 0){
+		*string = arenaAlloc(arena, length + 1);
+		if (length > 0 && fread(*string, length, 1, f) != 1)
+			return false;
+		(*string)[length] = '\0';
+	}
+	return true;
+}
+
+void writeCacheAction(FILE* f, action* act){
+	int32_t fields[4] = {act->type, act->button, act->policy, act->keys.count};
+	fwrite(fields, sizeof(fields), 1, f);
+	for (int i = 0; i < act->keys.count; i++){
+		uint64_t sym = act->keys.syms[i];
+		fwrite(&sym, sizeof(sym), 1, f);
+	}
+	writeCacheString(f, act->function);
+}
+
+bool readCacheAction(FILE* f, action* act, arenaBlock** arena){
+	int32_t fields[4];
+	memset(act, 0, sizeof(action));
+	if (fread(fields, sizeof(fields), 1, f) != 1 || fields[3] < 0 || fields[3] > MAX_CHORD_KEYS)
+		return false;
+	// The type indexes the stats and picks the dispatch, a damaged file must not reach either
+	if (fields[0] < ACTION_UNSET || fields[0] > ACTION_MACRO || fields[1] < 0 || fields[1] > 9 || fields[2] < POLICY_DROP || fields[2] > POLICY_QUEUE)
+		return false;
+	act->type = fields[0];
+	act->button = fields[1];
+	act->policy = fields[2];
+	act->keys.count = fields[3];
+	for (int i = 0; i < act->keys.count; i++){
+		uint64_t sym;
+		if (fread(&sym, sizeof(sym), 1, f) != 1)
+			return false;
+		act->keys.syms[i] = sym;
+	}
+	if (!readCacheString(f, &act->function, arena))
+		return false;
+	if (act->type == ACTION_MACRO){
+		if (act->function == NULL)
+			return false;
+		compileMacro(act, arena); // The steps are cheap to split again
+	}
+	linkAction(act);
+	return true;
+}
+
+void saveConfigCache(char* cachePath, config* cfg, struct stat* st, uint64_t hash){
+	char temp[PATH_MAX+8];
+	snprintf(temp, sizeof(temp), "%s.tmp", cachePath);
+	FILE* f = fopen(temp, "wb");
+	if (f == NULL)
+		return;
+
+	cacheHeader header = {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.mtime = st->st_mtim.tv_sec,
+		.mtimeNsec = st->st_mtim.tv_nsec,
+		.size = st->st_size,
+		.hash = hash,
+		.totalButtons = cfg->totalButtons,
+		.totalWheels = cfg->totalWheels,
+		.wheelWindow = cfg->wheelWindow,
+		.wheelAcceleration = cfg->wheelAcceleration,
+		.totalProfiles = cfg->totalProfiles,
+		.totalChords = cfg->totalChords
+	};
+	fwrite(&header, sizeof(header), 1, f);
+	for (int i = 0; i < cfg->totalButtons; i++){
+		int32_t type = cfg->events[i].type;
+		fwrite(&type, sizeof(type), 1, f);
+		writeCacheAction(f, &cfg->events[i].act);
+	}
+	for (int i = 0; i < cfg->totalChords; i++){
+		int32_t fields[2] = {cfg->chords[i].type, cfg->chords[i].chord};
+		fwrite(fields, sizeof(fields), 1, f);
+		writeCacheAction(f, &cfg->chords[i].act);
+	}
+	for (int i = 0; i < cfg->totalWheels; i++){
+		writeCacheAction(f, &cfg->wheelEvents[i].right);
+		writeCacheAction(f, &cfg->wheelEvents[i].left);
+	}
+	for (int i = 0; i < cfg->totalProfiles; i++){
+		writeCacheString(f, cfg->profiles[i].wmclass);
+		writeCacheString(f, cfg->profiles[i].file);
+	}
+	if (fclose(f) == 0)
+		rename(temp, cachePath);
+	else
+		unlink(temp);
+}
+
+config* loadConfigCache(char* cachePath, struct stat* st, uint64_t hash){
+	FILE* f = fopen(cachePath, "rb");
+	if (f == NULL)
+		return NULL;
+
+	cacheHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CACHE_MAGIC, 4) || header.version != CACHE_VERSION ||
+		header.mtime != st->st_mtim.tv_sec || header.mtimeNsec != st->st_mtim.tv_nsec || header.size != st->st_size || header.hash != hash ||
+		header.totalButtons < 0 || header.totalButtons > MAX_BUTTONS || header.totalWheels < 0 || header.totalWheels > MAX_WHEELS || header.totalProfiles < 0 || header.totalProfiles > 4096 || header.totalChords < 0 || header.totalChords > MAX_CHORDS){
+		fclose(f);
+		return NULL;
+	}
+
+	arenaBlock* arena = NULL;
+	config* cfg = (config*)arenaAlloc(&arena, sizeof(config));
+	memset(cfg, 0, sizeof(config));
+	cfg->totalButtons = header.totalButtons;
+	cfg->totalWheels = header.totalWheels;
+	cfg->wheelWindow = header.wheelWindow;
+	cfg->wheelAcceleration = header.wheelAcceleration;
+	cfg->events = (event*)arenaAlloc(&arena, cfg->totalButtons * sizeof(event));
+	cfg->wheelEvents = (wheel*)arenaAlloc(&arena, cfg->totalWheels * sizeof(wheel));
+	cfg->totalProfiles = header.totalProfiles;
+	cfg->profiles = (profile*)arenaAlloc(&arena, cfg->totalProfiles * sizeof(profile));
+	cfg->totalChords = header.totalChords;
+	cfg->chords = (event*)arenaAlloc(&arena, cfg->totalChords * sizeof(event));
+
+	bool ok = true;
+	for (int i = 0; ok && i < cfg->totalButtons; i++){
+		int32_t type;
+		ok = fread(&type, sizeof(type), 1, f) == 1 && readCacheAction(f, &cfg->events[i].act, &arena);
+		cfg->events[i].type = type;
+		cfg->events[i].policy = cfg->events[i].act.policy;
+	}
+	for (int i = 0; ok && i < cfg->totalChords; i++){
+		int32_t fields[2];
+		ok = fread(fields, sizeof(fields), 1, f) == 1 && readCacheAction(f, &cfg->chords[i].act, &arena);
+		cfg->chords[i].type = fields[0];
+		cfg->chords[i].chord = fields[1];
+		cfg->chords[i].policy = cfg->chords[i].act.policy;
+	}
+	for (int i = 0; ok && i < cfg->totalWheels; i++)
+		ok = readCacheAction(f, &cfg->wheelEvents[i].right, &arena) && readCacheAction(f, &cfg->wheelEvents[i].left, &arena);
+	for (int i = 0; ok && i < cfg->totalProfiles; i++){
+		cfg->profiles[i].cfg = NULL;
+		ok = readCacheString(f, &cfg->profiles[i].wmclass, &arena) && readCacheString(f, &cfg->profiles[i].file, &arena) && cfg->profiles[i].wmclass && cfg->profiles[i].file;
+	}
+	fclose(f);
+
+	cfg->arena = arena;
+	if (!ok){
+		cfg->totalProfiles = 0; // None of them are loaded yet
+		configFree(cfg);
+		return NULL;
+	}
+	configAdopt(cfg, cfg);
+	return cfg;
+}
+
+config* loadConfigfile(char* path, int debug, bool profiles);
+
+// Profiles are looked for like the config itself and cannot have profiles of their own
+void loadProfiles(config* cfg, int debug){
+	for (int i = 0; i < cfg->totalProfiles; i++){
+		char path[PATH_MAX];
+		profile* p = &cfg->profiles[i];
+		if (!findConfigfile(p->file, path, sizeof(path), false)){
+			printf("Profile for %s not found: %s\n", p->wmclass, p->file);
+			continue;
+		}
+		if (debug >= 1)
+			printf("Loading the %s profile...\n", p->wmclass);
+		p->cfg = loadConfigfile(path, debug, false);
+		if (p->cfg)
+			configAdopt(p->cfg, cfg);
+	}
+}
+
+config* loadConfigfile(char* path, int debug, bool profiles) {
+	char cachePath[PATH_MAX];
+	config* cfg = NULL;
+
+	FILE* f = fopen(path, "r");
+	struct stat st;
+	if (f == NULL || fstat(fileno(f), &st) < 0){
+		printf("Unable to read %s: %s\n", path, strerror(errno));
+		if (f)
+			fclose(f);
+		return NULL;
+	}
+	char* text = malloc(st.st_size + 1);
+	size_t length = fread(text, 1, st.st_size, f);
+	fclose(f);
+	uint64_t hash = hashBytes(text, length);
+
+	bool cached = useConfigCache && configCachePath(path, cachePath, sizeof(cachePath));
+	if (cached){
+		cfg = loadConfigCache(cachePath, &st, hash);
+		if (cfg && debug >= 1)
+			printf("Using compiled config %s\n", cachePath);
+	}
+	if (cfg == NULL){
+		cfg = parseConfigfile(text, length, path);
+		if (cached)
+			saveConfigCache(cachePath, cfg, &st, hash);
+	}
+	free(text);
+	if (cfg == NULL)
+		return NULL;
+
+	if (debug > 0){
+		printf("Wheel window: %d ms | Wheel acceleration: %.2f\n", cfg->wheelWindow, cfg->wheelAcceleration);
+		for (int i = 0; i < cfg->totalButtons; i++)
+			printf("Button: %d | Type: %d | Function: %s\n", i, cfg->events[i].type, cfg->events[i].act.function);
+		for (int i = 0; i < cfg->totalChords; i++)
+			printf("Chord: %#x | Type: %d | Function: %s\n", cfg->chords[i].chord, cfg->chords[i].type, cfg->chords[i].act.function);
+		printf("\n");
+		for (int i = 0; i < cfg->totalWheels; i++)
+			printf("Wheel Right: %s | Wheel Left: %s\n", cfg->wheelEvents[i].right.function, cfg->wheelEvents[i].left.function);
+		printf("\n");
+	}
+	if (profiles){
+		loadProfiles(cfg, debug);
+	}else if (cfg->totalProfiles > 0){
+		printf("%s is a profile, ignoring the profiles it lists\n", path);
+		cfg->totalProfiles = 0;
+	}
+	return cfg;
+}
+
+config* readConfigfile(int debug) {
+	char path[PATH_MAX];
+
+	// Load config file
+	if (debug >= 1){
+		printf("Loading config...\n");
+	}
+	if (!findConfigfile(file, path, sizeof(path), true))
+		return NULL;
+	return loadConfigfile(path, debug, true);
+}
+
+void configSlotSet(configSlot* slot, config* cfg){
+	atomic_fetch_add(&cfg->users, 1); // Held for as long as the slot points to it
+	slot->current = cfg;
+	slot->used = true;
+}
+
+// Loads the shared config and the configs of models that have their own file
+bool configSlotsLoad(int debug){
+	configSlot* shared = &configSlots[array_size(models)];
+	config* cfg = readConfigfile(debug);
+	if (cfg == NULL)
+		return false;
+	snprintf(shared->name, PATH_MAX, "%s", file);
+	configSlotSet(shared, cfg);
+
+	for (int i = 0; i < array_size(models); i++){
+		char path[PATH_MAX];
+		configSlot* slot = &configSlots[i];
+		models[i].slot = shared;
+		snprintf(slot->name, PATH_MAX, "%s.cfg", models[i].name);
+		if (!findConfigfile(slot->name, path, sizeof(path), false))
+			continue;
+		if (debug >= 1)
+			printf("Loading the %s config...\n", models[i].name);
+		if ((cfg = loadConfigfile(path, debug, true)) == NULL)
+			continue;
+		configSlotSet(slot, cfg);
+		models[i].slot = slot;
+	}
+	return true;
+}
+
+// Only called once the event loop has stopped
+void configSlotsFree(){
+	for (int i = 0; i < array_size(configSlots); i++){
+		configFree(configSlots[i].current);
+		configSlots[i].current = NULL;
+		configSlots[i].used = false;
+	}
+}
+
+struct {
+	pthread_t thread;
+	int inotify;
+	int wake; // eventfd used to stop the thread or have it free retired configs
+	atomic_bool stop;
+	bool started;
+	int debug;
+	config* retired; // Retired configs that commands still use
+} watcher = {.inotify = -1, .wake = -1};
+
+// Hands a config the reader no longer uses to the watcher to free
+void configRetire(config* cfg){
+	cfg->next = atomic_load(&retiredConfigs);
+	while (!atomic_compare_exchange_weak(&retiredConfigs, &cfg->next, cfg))
+		;
+}
+
+// Has the watcher free what was retired now rather than on its next pass
+void watcherWake(){
+	uint64_t one = 1;
+	if (watcher.started && write(watcher.wake, &one, sizeof(one)) < 0)
+		printf("Unable to wake the config watcher: %s\n", strerror(errno));
+}
+
+void watcherCollect(){
+	config* list = atomic_exchange(&retiredConfigs, NULL);
+	while (list){
+		config* next = list->next;
+		list->next = watcher.retired;
+		watcher.retired = list;
+		list = next;
+	}
+
+	config** cfg = &watcher.retired;
+	while (*cfg){
+		if (atomic_load(&(*cfg)->users) == 0){
+			config* done = *cfg;
+			*cfg = done->next;
+			configFree(done);
+		}else
+			cfg = &(*cfg)->next;
+	}
+}
+
+// Queues a fresh config for the event loop to switch to
+bool configSlotReload(configSlot* slot, char* path, int debug){
+	config* cfg = loadConfigfile(path, debug, true);
+	if (cfg == NULL)
+		return false;
+	// A config the event loop never picked up can be freed right away
+	config* unused = atomic_exchange(&slot->pending, cfg);
+	if (unused)
+		configFree(unused);
+	return true;
+}
+
+void watcherReload(configSlot* slot){
+	char path[PATH_MAX];
+	if (!findConfigfile(slot->name, path, sizeof(path), true))
+		return;
+
+	if (configSlotReload(slot, path, watcher.debug))
+		printf("Reloaded %s\n", path);
+	else
+		printf("Unable to reload %s, keeping the current config\n", path);
+}
+
+void* watcherThread(void* arg){
+	char names[array_size(configSlots)][PATH_MAX];
+	bool changed[array_size(configSlots)] = {0};
+	bool waiting = false;
+
+	for (int i = 0; i < array_size(configSlots); i++){
+		char copy[PATH_MAX];
+		snprintf(copy, sizeof(copy), "%s", configSlots[i].name);
+		snprintf(names[i], PATH_MAX, "%s", basename(copy));
+	}
+
+	while (true){
+		struct pollfd fds[2] = {{watcher.inotify, POLLIN, 0}, {watcher.wake, POLLIN, 0}};
+		int timeout = -1;
+		if (waiting)
+			timeout = RELOAD_DELAY; // Editors often write a file in several steps
+		else if (watcher.retired || atomic_load(&retiredConfigs))
+			timeout = 1000;
+
+		int ready = poll(fds, 2, timeout);
+		if (ready < 0 && errno != EINTR)
+			break;
+		if (fds[1].revents & POLLIN){
+			uint64_t count;
+			if (read(watcher.wake, &count, sizeof(count)) < 0 || watcher.stop)
+				break;
+		}
+
+		if (ready == 0 && waiting){
+			waiting = false;
+			for (int i = 0; i < array_size(configSlots); i++)
+				if (changed[i]){
+					changed[i] = false;
+					watcherReload(&configSlots[i]);
+				}
+		}
+		if (fds[0].revents & POLLIN){
+			char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t length = read(watcher.inotify, buffer, sizeof(buffer));
+			for (char* p = buffer; length > 0 && p < buffer + length; ){
+				struct inotify_event* ev = (struct inotify_event*)p;
+				for (int i = 0; ev->len > 0 && i < array_size(configSlots); i++)
+					if (configSlots[i].used && strcmp(ev->name, names[i]) == 0)
+						changed[i] = waiting = true;
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		watcherCollect();
+	}
+	return NULL;
+}
+
+bool watcherStart(int debug){
+	char dirs[3][PATH_MAX];
+	char copy[PATH_MAX];
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM;
+	int watches = 0;
+
+	// Watch every place findConfigfile looks in so any of them can take over
+	snprintf(copy, sizeof(copy), "%s", file);
+	snprintf(dirs[0], PATH_MAX, "%s", dirname(copy));
+	snprintf(dirs[1], PATH_MAX, "%s/.config/KD100", getpwuid(getuid())->pw_dir);
+	snprintf(dirs[2], PATH_MAX, "."); // Model configs
+
+	watcher.debug = debug;
+	watcher.inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	watcher.wake = eventfd(0, EFD_CLOEXEC);
+	if (watcher.inotify < 0 || watcher.wake < 0){
+		printf("Unable to watch the config file: %s\n", strerror(errno));
+		return false;
+	}
+	for (int i = 0; i < 3; i++)
+		if (inotify_add_watch(watcher.inotify, dirs[i], mask) >= 0)
+			watches++;
+	if (watches == 0 || pthread_create(&watcher.thread, NULL, watcherThread, NULL) != 0){
+		printf("Unable to watch the config file\n");
+		close(watcher.inotify);
+		close(watcher.wake);
+		watcher.inotify = watcher.wake = -1;
+		return false;
+	}
+	watcher.started = true;
+	return true;
+}
+
+void watcherStop(){
+	if (!watcher.started)
+		return;
+	uint64_t one = 1;
+	watcher.stop = true;
+	if (write(watcher.wake, &one, sizeof(one)) == sizeof(one))
+		pthread_join(watcher.thread, NULL);
+	close(watcher.inotify);
+	close(watcher.wake);
+	watcher.started = false;
+
+	// Nothing runs commands anymore at this point
+	for (int i = 0; i < array_size(configSlots); i++)
+		configFree(atomic_exchange(&configSlots[i].pending, NULL));
+	watcherCollect();
+	for (config* cfg = watcher.retired; cfg; ){
+		config* next = cfg->next;
+		configFree(cfg);
+		cfg = next;
+	}
+	watcher.retired = NULL;
+}
+
+bool checkDevice(int vendor, int product) {
+	for(int i = 0; i < array_size(models); i++) {
+		if (models[i].vendorId == vendor && models[i].productId == product) {
+			return true;
+		}
+	}
+	return false;
+}
+
+modelInfo* getDeviceModel(int vendor, int product) {
+	for(int i = 0; i < array_size(models); i++) {
+		if (models[i].vendorId == vendor && models[i].productId == product) {
+			return &models[i];
+		}
+	}
+	return NULL;
+}
+
+void buildKeycodeTables(){
+	for (int i = 0; i < array_size(models); i++){
+		memset(models[i].buttons, -1, KEYCODE_RANGE);
+		for (int k = 0; k < array_size(models[i].keycodes); k++)
+			if (models[i].keycodes[k] > 0 && models[i].keycodes[k] < KEYCODE_RANGE)
+				models[i].buttons[models[i].keycodes[k]] = k;
+	}
+}
+
+int decodeKD100(unsigned char* data){
+	int keycode = 0;
+	if (data[4] != 0)
+		keycode = data[4];
+	else if (data[5] != 0)
+		keycode = data[5] + 128;
+	else if (data[6] != 0)
+		keycode = data[6] + 256;
+	if (data[1] == 241)
+		keycode+=512;
+	return keycode;
+}
+
+int decodeK20(unsigned char* data){
+	if (data[1] != 0)
+		return data[1];
+	return data[2];
+}
+
+// Each of data[4], data[5] and data[6] is a bitmask of eight buttons, in button order
+bool stateKD100(unsigned char* data, uint32_t* pressed){
+	if (data[1] == 241)
+		return false;
+	*pressed = data[4] | data[5] << 8 | data[6] << 16;
+	return true;
+}
+
+// A keyboard report: modifier bits in data[1], then the usage codes of the keys down
+bool stateK20(unsigned char* data, uint32_t* pressed){
+	modelInfo* model = &models[K20];
+	*pressed = 0;
+	for (int b = 0; b < 8; b++){
+		int k = model->buttons[1 << b];
+		if ((data[1] & 1 << b) && k >= 0)
+			*pressed |= 1u << k;
+	}
+	for (int i = 2; i < 8; i++){
+		int k = data[i] ? model->buttons[data[i]] : -1;
+		if (k >= 0)
+			*pressed |= 1u << k;
+	}
+	return true;
+}
+
+// Buttons go in the bitmask bytes stateKD100 reads
+void encodeKD100(int keycode, unsigned char* data){
+	if (keycode >= 512){ // Wheel
+		data[1] = 241;
+		keycode -= 512;
+		if (keycode < 256)
+			data[4] = keycode;
+		else if (keycode < 384)
+			data[5] = keycode - 128;
+		else
+			data[6] = keycode - 256;
+	}else if (keycode <= 128)
+		data[4] = keycode;
+	else if (keycode <= 256)
+		data[5] = keycode - 128;
+	else
+		data[6] = keycode - 256;
+}
+
+void encodeK20(int keycode, unsigned char* data){
+	if ((keycode & (keycode - 1)) == 0 && keycode < 256) // Modifier bit
+		data[1] = keycode;
+	else
+		data[2] = keycode;
+}
+
+int hotplugCallback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data){
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED){
+		hotplugArrived = 1;
+	}else{
+		// Stop reading right away instead of waiting for the transfers to fail
+		pthread_mutex_lock(&keydialsLock);
+		for (keydial* kd = keydials; kd; kd = kd->next)
+			if (kd->dev == dev && kd->ring.err == 0)
+				kd->ring.err = LIBUSB_ERROR_NO_DEVICE;
+		pthread_mutex_unlock(&keydialsLock);
+	}
+	reader.pending = true;
+	return 0;
+}
+
+bool hotplugRegister(libusb_context *ctx, int debug){
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+		if (debug >= 1)
+			printf("Hotplug is not supported, polling for devices instead\n");
+		return false;
+	}
+	for (int i = 0; i < array_size(models); i++){
+		int err = libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS, models[i].vendorId, models[i].productId, LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, NULL, &hotplugHandles[i]);
+		if (err != LIBUSB_SUCCESS){
+			if (debug >= 1)
+				printf("Unable to register hotplug callback: %d\n", err);
+			while (i-- > 0)
+				libusb_hotplug_deregister_callback(ctx, hotplugHandles[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+void hotplugDeregister(libusb_context *ctx){
+	for (int i = 0; i < array_size(models); i++)
+		libusb_hotplug_deregister_callback(ctx, hotplugHandles[i]);
+}
+
+bool printTransferError(int err, int debug) {
+	// Potential errors
+	if (err == LIBUSB_ERROR_TIMEOUT)
+		printf("\nTIMEDOUT\n");
+	if (err == LIBUSB_ERROR_PIPE)
+		printf("\nPIPE ERROR\n");
+	if (err == LIBUSB_ERROR_NO_DEVICE)
+		printf("\nDEVICE DISCONNECTED\n");
+	if (err == LIBUSB_ERROR_OVERFLOW)
+		printf("\nOVERFLOW ERROR\n");
+	if (err == LIBUSB_ERROR_INVALID_PARAM)
+		printf("\nINVALID PARAMETERS\n");
+	if (err == -1)
+		printf("\nDEVICE IS ALREADY IN USE\n");
+	if (err < 0){
+		if (debug >= 1){
+			printf("Unable to retrieve data: %d\n", err);
+		}
+		return true;
+	}
+	return false;
+}
+
+int transferStatusError(enum libusb_transfer_status status){
+	switch (status){
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+int transfersMerging = 0; // Rings with a merged packet waiting for room, producer only
+
+// Also finds the buttons that went down since the last packet the ring took
+void packetDecode(transferRing* ring, packet* pkt){
+	int keycode = ring->model->decode(pkt->data);
+	pkt->wheel[0] = keycode == 641;
+	pkt->wheel[1] = keycode == 642;
+	pkt->buttons = ring->model->state(pkt->data, &pkt->pressed);
+	pkt->rose = 0;
+	if (pkt->buttons){
+		pkt->rose = pkt->pressed & ~ring->pressed;
+		ring->pressed = pkt->pressed;
+	}
+}
+
+// Queues the merged packet once the consumer has made room, returns whether it did
+bool transferFlush(transferRing* ring){
+	if (!ring->merging)
+		return false;
+	int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	int next = (head + 1) % PACKET_QUEUE;
+	if (next == atomic_load_explicit(&ring->tail, memory_order_acquire))
+		return false;
+	atomic_store_explicit(&ring->head, next, memory_order_release);
+	ring->merging = false;
+	transfersMerging--;
+	reader.pending = true;
+	return true;
+}
+
+// The producer copies the packet into the free slot at head and publishes it. When the ring is full
+// that slot is kept back and later packets are merged into it: wheel ticks add up and the newest
+// button state wins, so releases are never lost and a slow dispatcher never stalls the reads. Buttons
+// pressed and released again within the merge are kept in rose, so the dispatcher still taps them
+void transferPush(transferRing* ring, unsigned char* data, int length){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (captureFile)
+		captureWrite(ring, data, length, &now);
+	ring->received++;
+	transferFlush(ring);
+	int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	int next = (head + 1) % PACKET_QUEUE;
+	packet* pkt = &ring->packets[head];
+	if (ring->merging){
+		packet in;
+		memcpy(in.data, data, length);
+		memset(in.data + length, 0, PACKET_SIZE - length);
+		packetDecode(ring, &in);
+		for (int i = 0; i < 2; i++)
+			if (pkt->wheel[i] + in.wheel[i] <= USHRT_MAX)
+				pkt->wheel[i] += in.wheel[i];
+		if (in.buttons){
+			pkt->pressed = in.pressed;
+			pkt->rose |= in.rose;
+			pkt->buttons = true;
+		}
+		memcpy(pkt->data, in.data, PACKET_SIZE);
+		pkt->length = length;
+		ring->merged++;
+		return;
+	}
+	pkt->time = now;
+	memcpy(pkt->data, data, length);
+	memset(pkt->data + length, 0, PACKET_SIZE - length);
+	pkt->length = length;
+	packetDecode(ring, pkt);
+	if (next == atomic_load_explicit(&ring->tail, memory_order_acquire)){
+		ring->merging = true;
+		transfersMerging++;
+		return;
+	}
+	atomic_store_explicit(&ring->head, next, memory_order_release);
+}
+
+void transferCallback(struct libusb_transfer* transfer){
+	transferRing* ring = transfer->user_data;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED){
+		transferPush(ring, transfer->buffer, transfer->actual_length);
+	}else if (transfer->status == LIBUSB_TRANSFER_OVERFLOW){
+		ring->overruns++;
+	}else{
+		if (ring->err == 0 && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			ring->err = transferStatusError(transfer->status);
+		ring->inFlight--;
+		reader.pending = true;
+		return;
+	}
+
+	reader.pending = true;
+	// Hand the buffer straight back to the kernel so reads never pause
+	if (ring->err == 0 && libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)
+		return;
+	if (ring->err == 0)
+		ring->err = LIBUSB_ERROR_IO;
+	ring->inFlight--;
+}
+
+// Empties the ring before a device starts filling it
+void transferInit(transferRing* ring, modelInfo* model){
+	static uint8_t captureIds = 0;
+	memset(ring, 0, sizeof(transferRing));
+	ring->model = model;
+	ring->captureId = captureIds++;
+}
+
+int transferStart(transferRing* ring, libusb_device_handle* handle, modelInfo* model){
+	transferInit(ring, model);
+	for (int i = 0; i < TRANSFER_COUNT; i++){
+		struct libusb_transfer* transfer = libusb_alloc_transfer(0);
+		if (transfer == NULL)
+			return ring->err = LIBUSB_ERROR_NO_MEM;
+		libusb_fill_interrupt_transfer(transfer, handle, model->port, ring->buffers[i], PACKET_SIZE, transferCallback, ring, 0);
+		ring->transfers[i] = transfer;
+
+		int err = libusb_submit_transfer(transfer);
+		if (err < 0)
+			return ring->err = err;
+		ring->inFlight++;
+	}
+	return 0;
+}
+
+long elapsedUs(struct timespec* from, struct timespec* to){
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+void startupMark(char* step){
+	if (!startup.enabled)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("Startup: %-12s %8.3f ms (+%.3f ms)\n", step, elapsedUs(&startup.begin, &now) / 1000.0, elapsedUs(&startup.last, &now) / 1000.0);
+	startup.last = now;
+}
+
+bool transferPop(transferRing* ring, packet* pkt){
+	int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+		return false;
+	*pkt = ring->packets[tail];
+	atomic_store_explicit(&ring->tail, (tail + 1) % PACKET_QUEUE, memory_order_release);
+	return true;
+}
+
+void transferStop(libusb_context* ctx, transferRing* ring, int debug){
+	for (int i = 0; i < TRANSFER_COUNT; i++)
+		if (ring->transfers[i])
+			libusb_cancel_transfer(ring->transfers[i]);
+	while (ring->inFlight > 0)
+		if (libusb_handle_events(ctx) < 0)
+			break;
+	for (int i = 0; i < TRANSFER_COUNT; i++)
+		if (ring->transfers[i])
+			libusb_free_transfer(ring->transfers[i]);
+
+	if (debug >= 1)
+		printf("Packets: %lu | Merged: %lu | Overruns: %lu\n", ring->received, ring->merged, ring->overruns);
+}
+
+typedef struct child {
+	pid_t pid;
+	int fd; // pidfd, or -1 when the kernel does not support them
+	action* act;
+} child;
+
+struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	action* queue[COMMAND_QUEUE];
+	int head, tail;
+	int wake; // eventfd signalled when a request is queued
+	bool stop;
+	bool started;
+	child children[MAX_CHILDREN]; // Only touched by the executor thread
+	int childCount;
+	posix_spawnattr_t attr;
+	int debug;
+} executor = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = -1};
+
+// Every queued, pending or running command holds a reference on its config
+void executorRelease(action* act){
+	atomic_fetch_sub(&act->owner->users, 1);
+}
+
+void executorSpawn(action* act){
+	if (executor.childCount == MAX_CHILDREN){
+		if (executor.debug >= 1)
+			printf("Too many running commands, dropping: %s\n", act->function);
+		executorRelease(act);
+		return;
+	}
+
+	pid_t pid;
+	if (posix_spawn(&pid, act->argv[0], NULL, &executor.attr, act->argv, environ) != 0){
+		printf("Unable to run: %s\n", act->function);
+		executorRelease(act);
+		return;
+	}
+	child* c = &executor.children[executor.childCount++];
+	c->pid = pid;
+	c->act = act;
+	c->fd = -1;
+#ifdef SYS_pidfd_open
+	c->fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+	act->running++;
+}
+
+void executorRequest(action* act){
+	if (act->running == 0){
+		executorSpawn(act);
+		return;
+	}
+	switch (act->policy){
+		case POLICY_COALESCE:
+			if (act->pending == 0)
+				act->pending = 1;
+			else
+				executorRelease(act);
+			break;
+		case POLICY_QUEUE:
+			if (act->pending < COMMAND_QUEUE)
+				act->pending++;
+			else
+				executorRelease(act);
+			break;
+		default:
+			if (executor.debug >= 1)
+				printf("Still running, ignoring: %s\n", act->function);
+			executorRelease(act);
+			break;
+	}
+}
+
+void executorReap(int c){
+	action* act = executor.children[c].act;
+	if (executor.children[c].fd >= 0)
+		close(executor.children[c].fd);
+	executor.children[c] = executor.children[--executor.childCount];
+
+	// The pending run takes over the reference its request holds. The child's goes last, since
+	// it can be the config's last one and a retired config is freed as soon as that is dropped
+	act->running--;
+	if (act->running == 0 && act->pending > 0){
+		act->pending--;
+		executorSpawn(act);
+	}
+	executorRelease(act);
+}
+
+void* executorThread(void* arg){
+	while (!executor.stop){
+		struct pollfd fds[MAX_CHILDREN+1];
+		bool polling = false; // A child without a pidfd has to be checked on a timer
+		fds[0].fd = executor.wake;
+		fds[0].events = POLLIN;
+		for (int c = 0; c < executor.childCount; c++){
+			fds[c+1].fd = executor.children[c].fd;
+			fds[c+1].events = POLLIN;
+			if (executor.children[c].fd < 0)
+				polling = true;
+		}
+		if (poll(fds, executor.childCount+1, polling ? 100 : -1) < 0 && errno != EINTR)
+			break;
+
+		for (int c = executor.childCount-1; c >= 0; c--){
+			if (executor.children[c].fd >= 0 && !(fds[c+1].revents & POLLIN))
+				continue;
+			if (waitpid(executor.children[c].pid, NULL, WNOHANG) != 0)
+				executorReap(c);
+		}
+
+		if (fds[0].revents & POLLIN){
+			uint64_t count;
+			if (read(executor.wake, &count, sizeof(count)) < 0)
+				continue;
+			action* requests[COMMAND_QUEUE];
+			int n = 0;
+			pthread_mutex_lock(&executor.lock);
+			while (executor.tail != executor.head){
+				requests[n++] = executor.queue[executor.tail];
+				executor.tail = (executor.tail + 1) % COMMAND_QUEUE;
+			}
+			pthread_mutex_unlock(&executor.lock);
+			for (int i = 0; i < n; i++)
+				executorRequest(requests[i]);
+		}
+	}
+	return NULL;
+}
+
+bool executorStart(int debug){
+	sigset_t none;
+	sigemptyset(&none);
+	executor.debug = debug;
+	// The driver blocks the signals it reads through a signalfd; commands should not inherit that
+	posix_spawnattr_init(&executor.attr);
+	posix_spawnattr_setsigmask(&executor.attr, &none);
+	posix_spawnattr_setflags(&executor.attr, POSIX_SPAWN_SETSIGMASK);
+	executor.wake = eventfd(0, EFD_CLOEXEC);
+	if (executor.wake < 0){
+		printf("Unable to create the command executor: %s\n", strerror(errno));
+		return false;
+	}
+	if (pthread_create(&executor.thread, NULL, executorThread, NULL) != 0){
+		printf("Unable to start the command executor\n");
+		close(executor.wake);
+		executor.wake = -1;
+		return false;
+	}
+	executor.started = true;
+	return true;
+}
+
+void executorStop(){
+	if (!executor.started)
+		return;
+	// Commands that are still running are left alone
+	executor.stop = true;
+	uint64_t one = 1;
+	if (write(executor.wake, &one, sizeof(one)) < 0)
+		return;
+	pthread_join(executor.thread, NULL);
+	for (int c = 0; c < executor.childCount; c++)
+		if (executor.children[c].fd >= 0)
+			close(executor.children[c].fd);
+	close(executor.wake);
+	posix_spawnattr_destroy(&executor.attr);
+	executor.started = false;
+}
+
+void runCommand(action* act){
+	// Only queues the command; the USB path never waits on a child
+	bool queued = false;
+	atomic_fetch_add(&act->owner->users, 1);
+	pthread_mutex_lock(&executor.lock);
+	int next = (executor.head + 1) % COMMAND_QUEUE;
+	if (next != executor.tail){
+		executor.queue[executor.head] = act;
+		executor.head = next;
+		queued = true;
+	}
+	pthread_mutex_unlock(&executor.lock);
+
+	uint64_t one = 1;
+	if (!queued){
+		printf("Command queue is full, dropping: %s\n", act->function);
+		executorRelease(act);
+	}
+	else if (write(executor.wake, &one, sizeof(one)) < 0)
+		printf("Unable to wake the command executor\n");
+}
+
+unsigned long mockEvents = 0; // Events the mock backend was asked to send
+
+// Macros playing on the event loop; one timerfd is armed for the earliest pending step
+struct {
+	int timer;
+	int debug;
+	int count;
+	struct {
+		action* act;
+		int step; // Next step to run
+		struct timespec due;
+	} playing[MAX_MACROS];
+} macros = {.timer = -1};
+
+void timespecAddMs(struct timespec* t, int ms){
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (ms % 1000) * 1000000L;
+	if (t->tv_nsec >= 1000000000L){
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+bool timespecBefore(struct timespec* a, struct timespec* b){
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+void macroArm(){
+	struct itimerspec spec = {0};
+	for (int i = 0; i < macros.count; i++)
+		if (i == 0 || timespecBefore(&macros.playing[i].due, &spec.it_value))
+			spec.it_value = macros.playing[i].due;
+	if (macros.count > 0 && spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+		spec.it_value.tv_nsec = 1; // Zero would disarm the timer
+	timerfd_settime(macros.timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void macroFinish(int i){
+	if (macros.debug >= 1)
+		printf("Macro finished: %s\n", macros.playing[i].act->function);
+	atomic_fetch_sub(&macros.playing[i].act->owner->users, 1);
+	macros.playing[i] = macros.playing[--macros.count];
+}
+
+// Runs the steps that are due, returns false once the macro is done
+bool macroAdvance(int i, struct timespec* now){
+	action* act = macros.playing[i].act;
+	while (!timespecBefore(now, &macros.playing[i].due)){
+		if (macros.playing[i].step == act->totalSteps)
+			return false;
+		macroStep* s = &act->steps[macros.playing[i].step++];
+		if (s->act.type == ACTION_KEY){
+			HandlerRepeat(&s->act, 1);
+		}else if (s->act.type == ACTION_MOUSE){
+			Handler(&s->act, 2);
+			Handler(&s->act, 3);
+		}else{
+			// Delays count from when the step was due so they do not drift
+			timespecAddMs(&macros.playing[i].due, s->delay);
+		}
+	}
+	return true;
+}
+
+void macroEvents(int fd, uint32_t events, void* data){
+	uint64_t expirations;
+	struct timespec now;
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	injectBegin();
+	for (int i = 0; i < macros.count; ){
+		if (macroAdvance(i, &now))
+			i++;
+		else
+			macroFinish(i);
+	}
+	injectCommit();
+	macroArm();
+}
+
+// Starts a macro and runs its steps up to the first delay right away
+void macroPlay(action* act){
+	struct timespec now;
+	if (act->totalSteps == 0 || macros.timer < 0)
+		return;
+	for (int i = 0; i < macros.count; i++){
+		if (macros.playing[i].act == act){
+			if (macros.debug >= 1)
+				printf("Macro is still playing: %s\n", act->function);
+			return;
+		}
+	}
+	if (macros.count == MAX_MACROS){
+		printf("Too many macros playing, dropping: %s\n", act->function);
+		return;
+	}
+	atomic_fetch_add(&act->owner->users, 1); // The config stays alive until the macro is done
+	int i = macros.count++;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	macros.playing[i].act = act;
+	macros.playing[i].step = 0;
+	macros.playing[i].due = now;
+	if (!macroAdvance(i, &now))
+		macroFinish(i);
+	macroArm();
+}
+
+// Application with the input focus on X11, for profiles
+struct {
+	Display* display; // display, or a connection of its own with the xdotool backend
+	Atom activeWindow;
+	char wmclass[256];
+	char wmname[256];
+	unsigned int generation; // Bumped when the focus moves
+	int debug;
+} focus;
+
+// The lookup only happens when the focus or the config changes
+config* configProfile(config* cfg){
+	if (focus.generation == 0)
+		return cfg;
+	for (int i = 0; i < cfg->totalProfiles; i++){
+		profile* p = &cfg->profiles[i];
+		if (p->cfg && (strcasecmp(p->wmclass, focus.wmclass) == 0 || strcasecmp(p->wmclass, focus.wmname) == 0))
+			return p->cfg;
+	}
+	return cfg;
+}
+
+struct {
+	int epoll;
+	int signals; // signalfd for SIGINT, SIGTERM and SIGUSR1
+	bool running;
+	loopSource sources[MAX_SOURCES];
+	libusb_context* ctx;
+} loop = {.epoll = -1, .signals = -1};
+
+void wheelTick(wheelBatch* batch, action* act, struct timespec* time){
+	long interval = elapsedUs(&batch->last, time);
+	if (batch->last.tv_sec == 0 || interval > 500000)
+		batch->rate = 0;
+	else if (interval > 0)
+		batch->rate = 0.7 * batch->rate + 0.3 * (1000000.0 / interval);
+	batch->last = *time;
+
+	if (batch->count == 0)
+		batch->first = *time;
+	batch->act = act;
+	batch->count++;
+}
+
+void histogramAdd(histogram* h, long us){
+	int bucket = 0;
+	if (us < 0)
+		us = 0;
+	while (bucket < LATENCY_BUCKETS-1 && us >= 1L << bucket)
+		bucket++;
+	h->buckets[bucket]++;
+	h->count++;
+	h->total += us;
+	if (us > h->max)
+		h->max = us;
+}
+
+// Upper bound of the bucket holding the given fraction of events
+long histogramPercentile(histogram* h, double fraction){
+	unsigned long seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++){
+		seen += h->buckets[i];
+		if (seen > 0 && seen >= fraction * h->count)
+			return i < LATENCY_BUCKETS-1 && 1L << i <= h->max ? 1L << i : h->max;
+	}
+	return 0;
+}
+
+void histogramPrint(FILE* out, char* name, histogram* h){
+	if (h->count == 0){
+		fprintf(out, "%s: no events\n", name);
+		return;
+	}
+	fprintf(out, "%s: %lu events | avg %ld us | p50 < %ld us | p99 < %ld us | max %ld us\n", name, h->count, h->total / (long)h->count, histogramPercentile(h, 0.5), histogramPercentile(h, 0.99), h->max);
+	for (int i = 0; i < LATENCY_BUCKETS; i++){
+		if (h->buckets[i] == 0)
+			continue;
+		if (i < LATENCY_BUCKETS-1)
+			fprintf(out, "\t< %8ld us: %lu\n", 1L << i, h->buckets[i]);
+		else
+			fprintf(out, "\t>= %7ld us: %lu\n", 1L << (i-1), h->buckets[i]);
+	}
+}
+
+// Records an injection that finished just now
+void statsInjected(int type, struct timespec* completed, struct timespec* dispatched){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long us = elapsedUs(dispatched, &now);
+	histogramAdd(&stats.inject, us);
+	histogramAdd(&stats.total, elapsedUs(completed, &now));
+	stats.actions[type]++;
+	stats.actionUs[type] += us;
+}
+
+void statsPrint(FILE* out){
+	fprintf(out, "\nPackets dispatched: %lu\n", stats.packets);
+#ifdef COUNT_ALLOCATIONS
+	fprintf(out, "Heap allocations while dispatching: %lu\n", stats.allocations);
+#endif
+	histogramPrint(out, "USB completion to dispatch", &stats.queue);
+	histogramPrint(out, "Dispatch to injection", &stats.inject);
+	histogramPrint(out, "USB completion to injection", &stats.total);
+	for (int i = 0; i <= STATS_WHEEL; i++)
+		if (stats.actions[i] > 0)
+			fprintf(out, "Action %s: %lu | avg %ld us\n", statsNames[i], stats.actions[i], stats.actionUs[i] / (long)stats.actions[i]);
+	for (keydial* kd = keydials; kd; kd = kd->next)
+		fprintf(out, "%s packets: %lu | Merged: %lu | Overruns: %lu\n", kd->model->name, kd->ring.received, kd->ring.merged, kd->ring.overruns);
+	fflush(out);
+}
+
+void wheelFlush(wheelBatch* batch, config* cfg, int debug){
+	if (batch->count == 0)
+		return;
+
+	struct timespec dispatched;
+	if (stats.enabled)
+		clock_gettime(CLOCK_MONOTONIC, &dispatched);
+
+	int repeat = batch->count;
+	if (cfg->wheelAcceleration > 0 && batch->rate > WHEEL_BASE_RATE)
+		repeat += (int)(batch->count * cfg->wheelAcceleration * (batch->rate - WHEEL_BASE_RATE) / WHEEL_BASE_RATE);
+	if (repeat > WHEEL_MAX_REPEAT)
+		repeat = WHEEL_MAX_REPEAT;
+	if (debug >= 1)
+		printf("Wheel: %d ticks at %.1f/s -> %d\n", batch->count, batch->rate, repeat);
+
+	HandlerRepeat(batch->act, repeat);
+	if (stats.enabled)
+		statsInjected(STATS_WHEEL, &batch->first, &dispatched);
+	batch->count = 0;
+}
+
+// Lets go of what the given buttons hold, returns the action type released or -1
+int keydialLift(keydial* kd, uint32_t buttons){
+	int type = -1, kept = 0;
+	for (int i = 0; i < kd->heldCount; i++){
+		action* act = kd->held[i].act;
+		if (kd->held[i].buttons & buttons){
+			Handler(act, act->type == ACTION_KEY ? 1 : 3);
+			type = act->type;
+		}else
+			kd->held[kept++] = kd->held[i];
+	}
+	kd->heldCount = kept;
+	return type;
+}
+
+void keydialHold(keydial* kd, action* act, uint32_t buttons){
+	if (kd->heldCount == MAX_HELD)
+		keydialLift(kd, kd->held[0].buttons);
+	Handler(act, act->type == ACTION_KEY ? 0 : 2);
+	kd->held[kd->heldCount].act = act;
+	kd->held[kd->heldCount].buttons = buttons;
+	kd->heldCount++;
+}
+
+void keydialRelease(keydial* kd, int debug){
+	injectBegin();
+	wheelFlush(&kd->batch, kd->active, debug);
+	keydialLift(kd, ~0u);
+	injectCommit();
+}
+
+// Moves a device to its slot's current config, and the profile of the focused application, between packets
+void keydialUseConfig(keydial* kd, int debug){
+	config* cfg = kd->model->slot->current;
+	if (kd->cfg == cfg && kd->focusGeneration == focus.generation)
+		return;
+	config* active = configProfile(cfg);
+	kd->focusGeneration = focus.generation;
+	if (kd->cfg == cfg && kd->active == active)
+		return;
+
+	if (kd->active != NULL)
+		keydialRelease(kd, debug);
+	if (kd->cfg != cfg){
+		if (kd->cfg != NULL)
+			atomic_fetch_sub(&kd->cfg->users, 1);
+		atomic_fetch_add(&cfg->users, 1);
+		kd->cfg = cfg;
+	}
+	if (debug >= 1 && kd->active != NULL)
+		printf("%s: %s\n", kd->model->name, active == cfg ? "default config" : focus.wmclass);
+	kd->active = active;
+	if (kd->wheelFunction >= active->totalWheels)
+		kd->wheelFunction = 0;
+}
+
+// Picks up configs the watcher reloaded
+void configSlotsUpdate(){
+	for (int i = 0; i < array_size(configSlots); i++){
+		configSlot* slot = &configSlots[i];
+		config* next = atomic_exchange(&slot->pending, NULL);
+		if (next == NULL)
+			continue;
+		config* old = slot->current;
+		configSlotSet(slot, next);
+		atomic_fetch_sub(&old->users, 1);
+		configRetire(old); // Freed once no device or command uses it
+		watcherWake();
+	}
+}
+
+// Runs the action of the buttons just pressed, returns the action type sent or -1
+int keydialAction(keydial* kd, action* act, uint32_t buttons, int debug){
+	config* cfg = kd->active;
+	switch (act->type){
+		case ACTION_NONE:
+			return keydialLift(kd, ~0u) >= 0 ? act->type : -1;
+		case ACTION_KEY:
+		case ACTION_MOUSE:
+			keydialHold(kd, act, buttons);
+			return act->type;
+		case ACTION_SWAP:
+			if (kd->wheelFunction < cfg->totalWheels-1){
+				kd->wheelFunction++;
+			}else
+				kd->wheelFunction=0;
+			if (debug >= 1 && cfg->totalWheels > 0){
+				printf("Function: %s | %s\n", cfg->wheelEvents[kd->wheelFunction].left.function, cfg->wheelEvents[kd->wheelFunction].right.function);
+			}
+			return -1;
+		case ACTION_COMMAND:
+			runCommand(act); // Counted once it is queued
+			return act->type;
+		case ACTION_MACRO:
+			macroPlay(act);
+			return act->type;
+		default:
+			return -1;
+	}
+}
+
+// The chord with the most buttons that the newly pressed button completes
+event* keydialChord(config* cfg, uint32_t pressed, int k){
+	event* best = NULL;
+	for (int i = 0; i < cfg->totalChords; i++){
+		uint32_t chord = cfg->chords[i].chord;
+		if ((chord & 1u << k) && (chord & pressed) == chord && (best == NULL || __builtin_popcount(chord) > __builtin_popcount(best->chord)))
+			best = &cfg->chords[i];
+	}
+	return best;
+}
+
+// Lock-free ring in shared memory that takes the place of the per-packet debug output
+struct {
+	char name[NAME_MAX];
+	traceHeader* header; // NULL when not tracing
+	traceRecord* records;
+	size_t size;
+} trace;
+
+size_t traceSize(uint32_t records){
+	return sizeof(traceHeader) + records * sizeof(traceRecord);
+}
+
+// shm_open wants a name starting with a slash
+void traceName(char* name){
+	snprintf(trace.name, sizeof(trace.name), "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+bool traceOpen(char* name){
+	traceName(name);
+	trace.size = traceSize(TRACE_RECORDS);
+	int fd = shm_open(trace.name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || ftruncate(fd, trace.size) < 0){
+		printf("Unable to create the trace %s: %s\n", trace.name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	void* map = mmap(NULL, trace.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED){
+		printf("Unable to map the trace %s: %s\n", trace.name, strerror(errno));
+		return false;
+	}
+	memset(map, 0, trace.size); // Pages are all there before packets arrive
+	trace.header = map;
+	trace.records = (traceRecord*)(trace.header + 1);
+	memcpy(trace.header->magic, TRACE_MAGIC, 4);
+	trace.header->version = TRACE_VERSION;
+	trace.header->records = TRACE_RECORDS;
+	trace.header->recordSize = sizeof(traceRecord);
+	printf("Tracing to %s, read it with -traceread %s\n", trace.name, trace.name + 1);
+	return true;
+}
+
+// The segment stays behind so the last packets can be read after the driver exits
+void traceClose(){
+	if (trace.header)
+		munmap(trace.header, trace.size);
+	trace.header = NULL;
+}
+
+void traceWrite(keydial* kd, packet* pkt, int keycode, int action, struct timespec* dispatched){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t n = atomic_load_explicit(&trace.header->head, memory_order_relaxed);
+	traceRecord* rec = &trace.records[n % TRACE_RECORDS];
+	atomic_store_explicit(&rec->seq, 2 * n + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	rec->time = pkt->time.tv_sec * 1000000000LL + pkt->time.tv_nsec;
+	rec->duration = (now.tv_sec - dispatched->tv_sec) * 1000000000L + now.tv_nsec - dispatched->tv_nsec;
+	rec->pressed = kd->pressed;
+	rec->keycode = keycode;
+	rec->action = action;
+	rec->model = kd->model - models;
+	rec->device = kd->ring.captureId;
+	rec->length = pkt->length;
+	rec->wheel[0] = pkt->wheel[0];
+	rec->wheel[1] = pkt->wheel[1];
+	memcpy(rec->data, pkt->data, PACKET_SIZE);
+	atomic_store_explicit(&rec->seq, 2 * n + 2, memory_order_release);
+	atomic_store_explicit(&trace.header->head, n + 1, memory_order_release);
+}
+
+volatile sig_atomic_t traceStop = 0;
+
+void traceSignal(int signal){
+	traceStop = 1;
+}
+
+// Follows the trace of a running driver and prints what the debug output would have
+int traceRead(char* name){
+	traceName(name);
+	int fd = shm_open(trace.name, O_RDONLY | O_CLOEXEC, 0);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(traceHeader)){
+		printf("Unable to open the trace %s: %s\n", trace.name, fd < 0 ? strerror(errno) : "too short");
+		if (fd >= 0)
+			close(fd);
+		return -8;
+	}
+	traceHeader* header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, 4) || header->version != TRACE_VERSION ||
+		header->recordSize != sizeof(traceRecord) || header->records == 0 || st.st_size < traceSize(header->records)){
+		printf("%s is not a trace this version can read\n", trace.name);
+		if (header != MAP_FAILED)
+			munmap(header, st.st_size);
+		return -8;
+	}
+	traceRecord* records = (traceRecord*)(header + 1);
+
+	signal(SIGINT, traceSignal);
+	signal(SIGTERM, traceSignal);
+	uint64_t cursor = 0;
+	while (!traceStop){
+		uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+		if (head < cursor){
+			printf("The driver started again\n");
+			cursor = 0;
+		}
+		if (head - cursor > header->records){
+			printf("Lost %llu records\n", (unsigned long long)(head - cursor - header->records));
+			cursor = head - header->records;
+		}
+		for (; cursor < head; cursor++){
+			traceRecord* shared = &records[cursor % header->records];
+			traceRecord rec;
+			uint64_t seq = atomic_load_explicit(&shared->seq, memory_order_acquire);
+			memcpy((char*)&rec + sizeof(rec.seq), (char*)shared + sizeof(rec.seq), sizeof(rec) - sizeof(rec.seq));
+			atomic_thread_fence(memory_order_acquire);
+			if (seq != 2 * cursor + 2 || atomic_load_explicit(&shared->seq, memory_order_relaxed) != seq){
+				printf("Lost a record being overwritten\n");
+				continue;
+			}
+			printf("[%lld.%06lld] %s", (long long)(rec.time / 1000000000), (long long)(rec.time % 1000000000 / 1000), rec.model < array_size(models) ? models[rec.model].name : "?");
+			if (rec.device != 0)
+				printf(" #%d", rec.device);
+			printf(" Keycode: %d Buttons: %#x", rec.keycode, rec.pressed);
+			if (rec.wheel[0] || rec.wheel[1])
+				printf(" Wheel: +%d -%d", rec.wheel[0], rec.wheel[1]);
+			if (rec.action >= 0 && rec.action <= STATS_WHEEL)
+				printf(" Action: %s", statsNames[rec.action]);
+			printf(" | %.1f us\nDATA: [%d", rec.duration / 1000.0, rec.data[0]);
+			for (int i = 1; i < rec.length && i < PACKET_SIZE; i++)
+				printf(", %d", rec.data[i]);
+			printf("]\n");
+		}
+		fflush(stdout);
+		usleep(10000);
+	}
+	munmap(header, st.st_size);
+	return 0;
+}
+
+// Runs the actions of the buttons in down, chorded with the others in pressed, returns the last type sent
+int keydialPress(keydial* kd, uint32_t down, uint32_t pressed, int debug){
+	config* cfg = kd->active;
+	int injected = -1;
+	while (down){
+		int k = __builtin_ctz(down);
+		event* ev = keydialChord(cfg, pressed, k);
+		uint32_t buttons = ev ? ev->chord : 1u << k;
+		down &= ~buttons;
+		if (ev == NULL && k < cfg->totalButtons)
+			ev = &cfg->events[k];
+		if (ev == NULL)
+			continue;
+		if (debug >= 2 && trace.header == NULL) {
+			printf("Key: %d Type: %d function: %s\n", k, ev->type, ev->act.function);
+		}
+		int type = keydialAction(kd, &ev->act, buttons, debug);
+		if (type >= 0)
+			injected = type;
+	}
+	return injected;
+}
+
+void keydialDispatch(keydial* kd, packet* pkt, int debug, int dry) {
+	config* cfg = kd->active;
+	wheel* wheelEvents = cfg->wheelEvents;
+	unsigned char* data = pkt->data;
+	int injected = -1; // Action type sent this packet, for the stats
+	bool print = trace.header == NULL; // The trace replaces the debug output
+	struct timespec dispatched;
+
+	if (stats.enabled || !print)
+		clock_gettime(CLOCK_MONOTONIC, &dispatched);
+	if (stats.enabled){
+		histogramAdd(&stats.queue, elapsedUs(&pkt->time, &dispatched));
+		stats.packets++;
+	}
+
+	unsigned long allocations = allocationCount();
+	injectBegin(); // Everything this packet does goes out in one flush
+
+	// The packet was decoded when it was queued
+	uint32_t held = kd->pressed;
+	uint32_t pressed = pkt->buttons && !dry ? pkt->pressed : held;
+	uint32_t changed = pressed ^ held;
+	kd->pressed = pressed;
+	// A merge can hide a press: tapped buttons are up again, and released then pressed ones look held
+	uint32_t rose = pkt->buttons && !dry ? pkt->rose : 0;
+	uint32_t taps = rose & ~pressed;
+	uint32_t again = rose & pressed & held;
+
+	int keycode = debug >= 1 || !print ? kd->model->decode(data) : 0;
+	if (debug >= 1 && print && keycode != 0)
+		printf("[%ld.%06ld] %s Keycode: %d Buttons: %#x\n", (long)pkt->time.tv_sec, pkt->time.tv_nsec / 1000, kd->model->name, keycode, pressed);
+	bool wheelTurn = (pkt->wheel[0] || pkt->wheel[1]) && cfg->totalWheels > 0 && !dry;
+	for (int i = 0; wheelTurn && i < 2; i++){
+		action* act = i == 0 ? &wheelEvents[kd->wheelFunction].right : &wheelEvents[kd->wheelFunction].left;
+		if (pkt->wheel[i] && kd->batch.count > 0 && kd->batch.act != act)
+			wheelFlush(&kd->batch, cfg, debug);
+		for (int t = 0; t < pkt->wheel[i]; t++)
+			wheelTick(&kd->batch, act, &pkt->time);
+	}
+	if (changed || rose){
+		// Anything else has to go out after the ticks that came before it
+		wheelFlush(&kd->batch, cfg, debug);
+	}
+
+	// Only edges are dispatched, a button held across packets is not pressed again
+	int type = keydialLift(kd, (changed & ~pressed) | again);
+	if (type >= 0)
+		injected = type;
+	if (taps){
+		type = keydialPress(kd, taps, pressed | taps, debug);
+		if (type >= 0)
+			injected = type;
+		keydialLift(kd, taps);
+	}
+	type = keydialPress(kd, (changed & pressed) | again, pressed, debug);
+	if (type >= 0)
+		injected = type;
+	injectCommit();
+	stats.allocations += allocationCount() - allocations;
+	if (stats.enabled && injected >= 0)
+		statsInjected(injected, &pkt->time, &dispatched);
+
+	if (!print)
+		traceWrite(kd, pkt, keycode, injected, &dispatched);
+	else if(debug == 2 || dry){
+		printf("DATA: [%d", data[0]);
+		for (int i = 1; i < PACKET_SIZE; i++){
+			printf(", %d", data[i]);
+		}
+		printf("]\n");
+	}
+}
+
+// Milliseconds until the pending wheel ticks have to be sent, -1 when there are none
+int keydialTimeout(keydial* kd){
+	if (kd->batch.count == 0)
+		return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long remaining = kd->active->wheelWindow * 1000L - elapsedUs(&kd->batch.first, &now);
+	return remaining <= 0 ? 0 : (remaining + 999) / 1000;
+}
+
+
+bool captureOpen(char* path){
+	captureHeader header = {.version = CAPTURE_VERSION};
+	memcpy(header.magic, CAPTURE_MAGIC, 4);
+	static char buffer[64*1024]; // Allocated up front instead of on the first packet
+	captureFile = fopen(path, "wbe");
+	if (captureFile)
+		setvbuf(captureFile, buffer, _IOFBF, sizeof(buffer));
+	if (captureFile == NULL || fwrite(&header, sizeof(header), 1, captureFile) != 1){
+		printf("Unable to record to %s: %s\n", path, strerror(errno));
+		if (captureFile)
+			fclose(captureFile);
+		captureFile = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Called by the producer, so packets are saved as they arrived and not as merged in the ring
+void captureWrite(transferRing* ring, unsigned char* data, int length, struct timespec* time){
+	captureRecord rec = {
+		.time = time->tv_sec * 1000000000LL + time->tv_nsec,
+		.model = ring->model - models,
+		.device = ring->captureId,
+		.length = length
+	};
+	fwrite(&rec, sizeof(rec), 1, captureFile);
+	fwrite(data, 1, length, captureFile);
+}
+
+void captureClose(){
+	if (captureFile && fclose(captureFile) != 0)
+		printf("Unable to finish the capture: %s\n", strerror(errno));
+	captureFile = NULL;
+}
+
+transport usbTransport;
+
+void keydialProcess(keydial* kd, int debug, int dry){
+	packet pkt;
+	bool producer = !reader.enabled || kd->transport != &usbTransport; // The event loop completes the transfers itself
+	keydialUseConfig(kd, debug);
+	do {
+		while (transferPop(&kd->ring, &pkt)){
+			keydialDispatch(kd, &pkt, debug, dry);
+		}
+	} while (producer && transferFlush(&kd->ring));
+	if (keydialTimeout(kd) == 0) // No more ticks within the window
+		wheelFlush(&kd->batch, kd->active, debug);
+}
+
+keydial* keydialFind(libusb_device* dev){
+	for (keydial* kd = keydials; kd; kd = kd->next)
+		if (kd->dev == dev)
+			return kd;
+	return NULL;
+}
+
+void keydialClose(keydial* kd, int debug){
+	if (kd->cfg != NULL){
+		keydialRelease(kd, debug);
+		atomic_fetch_sub(&kd->cfg->users, 1);
+	}
+	kd->transport->close(kd, debug);
+	free(kd);
+}
+
+// Starts dispatching the packets of a device that is ready
+void keydialAdd(keydial* kd, int debug){
+	keydialUseConfig(kd, debug);
+	pthread_mutex_lock(&keydialsLock);
+	kd->next = keydials;
+	keydials = kd;
+	pthread_mutex_unlock(&keydialsLock);
+	if (startup.enabled){
+		startupMark("device");
+		loop.running = false; // Measured, nothing left to do
+	}
+}
+
+struct {
+	bool hotplug;
+	struct timespec lastScan;
+	int c; // Index of the loading character to display when waiting for a device
+	int retry; // timerfd that rescans once a device that failed may be opened again
+	int backoff; // Milliseconds until the next retry, 0 after a device opened
+} usb = {.retry = -1};
+
+void usbRetryEvents(int fd, uint32_t events, void* data){
+	uint64_t expirations;
+	if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		hotplugArrived = 1;
+}
+
+// Opens a device that is still plugged in again later, waiting longer every time it keeps failing
+void usbRetry(int debug){
+	if (usb.retry < 0){
+		usb.retry = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (usb.retry < 0 || !loopAdd(usb.retry, EPOLLIN, usbRetryEvents, NULL)){
+			printf("Unable to retry the device: %s\n", strerror(errno));
+			if (usb.retry >= 0)
+				close(usb.retry);
+			usb.retry = -1;
+			return;
+		}
+	}
+	struct itimerspec armed;
+	if (timerfd_gettime(usb.retry, &armed) == 0 && (armed.it_value.tv_sec || armed.it_value.tv_nsec))
+		return; // Another device failed in the same scan
+	usb.backoff = usb.backoff == 0 ? RETRY_MIN : usb.backoff * 2;
+	if (usb.backoff > RETRY_MAX)
+		usb.backoff = RETRY_MAX;
+	struct itimerspec timer = {{0, 0}, {usb.backoff / 1000, (usb.backoff % 1000) * 1000000L}};
+	timerfd_settime(usb.retry, 0, &timer, NULL);
+	if (debug >= 1)
+		printf("Opening the device again in %d ms\n", usb.backoff);
+}
+
+void usbClose(keydial* kd, int debug){
+	transferStop(loop.ctx, &kd->ring, debug);
+
+	// Cleanup
+	for (int x = 0; x < kd->interfaces; x++) {
+		if (debug >= 1){
+			printf("Releasing interface %d...\n", x);
+		}
+		libusb_release_interface(kd->handle, x);
+	}
+	printf("Closing %s...\n", kd->model->name);
+	libusb_close(kd->handle);
+	if (kd->ring.err != LIBUSB_ERROR_NO_DEVICE && usb.hotplug)
+		usbRetry(debug); // Still plugged in, open it again
+}
+
+// Claims the device and starts reading it
+keydial* usbOpen(libusb_device* dev, modelInfo* model, int debug){
+	libusb_device_handle* handle;
+	int err = libusb_open(dev, &handle);
+	if (err < 0){
+		printf("\nUnable to open device. Error: %d\n", err);
+		if (err == LIBUSB_ERROR_ACCESS)
+			printf("Error: Permission denied\n");
+		return NULL;
+	}
+	if (debug > 0){
+		struct libusb_device_descriptor devDesc;
+		char info[200] = "";
+		if (libusb_get_device_descriptor(dev, &devDesc) == LIBUSB_SUCCESS){
+			libusb_get_string_descriptor_ascii(handle, devDesc.iProduct, (unsigned char *) info, sizeof(info));
+			printf("\nUsing: %04x:%04x (Bus: %03d Device: %03d) Name: %s\n", devDesc.idVendor, devDesc.idProduct, libusb_get_bus_number(dev), libusb_get_device_address(dev), info);
+		}
+	}
+	printf("Starting driver for the %s...\n", model->name);
+
+	keydial* kd = calloc(1, sizeof(keydial));
+	kd->dev = dev;
+	kd->handle = handle;
+	kd->model = model;
+	kd->transport = &usbTransport;
+
+	// Read device and claim interfaces
+	struct libusb_config_descriptor *desc; // USB description (For claiming interfaces)
+	if (libusb_get_config_descriptor(dev, 0, &desc) == LIBUSB_SUCCESS){
+		kd->interfaces = desc->bNumInterfaces;
+		libusb_free_config_descriptor(desc);
+	}
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	if (debug >= 1)
+		printf("Claiming interfaces... \n");
+	for (int x = 0; x < kd->interfaces; x++){
+		libusb_kernel_driver_active(handle, x);
+		if (libusb_claim_interface(handle, x) != LIBUSB_SUCCESS && debug >= 1)
+			printf("Failed to claim interface %d\n", x);
+	}
+
+	if (transferStart(&kd->ring, handle, model) < 0){
+		printTransferError(kd->ring.err, debug);
+		usbClose(kd, debug);
+		free(kd);
+		return NULL;
+	}
+	printf("Driver is running!\n");
+	usb.backoff = 0;
+	keydialAdd(kd, debug);
+	return kd;
+}
+
+// Bus and chain of ports, which stay the same as long as the device is plugged into the same port
+void usbDevicePath(libusb_device* dev, char* out, size_t size){
+	uint8_t ports[7];
+	int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	int n = snprintf(out, size, "%d", libusb_get_bus_number(dev));
+	for (int i = 0; i < count && n < size; i++)
+		n += snprintf(out + n, size - n, "%c%d", i == 0 ? '-' : '.', ports[i]);
+}
+
+void lastDevicePath(char* out, size_t size){
+	char dir[PATH_MAX];
+	cacheDir(dir, sizeof(dir));
+	snprintf(out, size, "%s/last-device", dir);
+}
+
+// Remembers the picked device, so the next start opens it without asking
+void lastDeviceSave(libusb_device* dev, modelInfo* model){
+	char path[PATH_MAX], port[32];
+	lastDevicePath(path, sizeof(path));
+	usbDevicePath(dev, port, sizeof(port));
+	FILE* f = fopen(path, "w");
+	if (f == NULL)
+		return;
+	fprintf(f, "%04x:%04x %s\n", model->vendorId, model->productId, port);
+	fclose(f);
+}
+
+// Index of the remembered device among the ones found, or -1
+int lastDeviceFind(libusb_device** devs, modelInfo** found, int count){
+	char path[PATH_MAX], port[32], saved[32];
+	unsigned int vendor, product;
+	lastDevicePath(path, sizeof(path));
+	FILE* f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	int fields = fscanf(f, "%x:%x %31s", &vendor, &product, saved);
+	fclose(f);
+	if (fields != 3)
+		return -1;
+	for (int d = 0; d < count; d++){
+		usbDevicePath(devs[d], port, sizeof(port));
+		if (found[d]->vendorId == vendor && found[d]->productId == product && strcmp(port, saved) == 0)
+			return d;
+	}
+	return -1;
+}
+
+// Reads the picked device, still taking the signals the event loop reads since they are blocked
+// Returns false on end of input or when the driver is stopped
+bool pickerRead(char* buf, int size){
+	struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {loop.signals, POLLIN, 0}};
+	while (loop.running){
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			return false;
+		if (fds[1].revents & POLLIN)
+			signalEvents(loop.signals, EPOLLIN, NULL);
+		if (loop.running && fds[0].revents){
+			ssize_t n = read(STDIN_FILENO, buf, size - 1);
+			if (n <= 0)
+				return false;
+			buf[n] = '\0';
+			return true;
+		}
+	}
+	return false;
+}
+
+// Opens supported devices that are not open yet; without accept the user picks one
+void scanDevices(int accept, int debug){
+	libusb_device **devs; // List of USB devices
+
+	ssize_t count = libusb_get_device_list(loop.ctx, &devs);
+	if (count < 0){
+		printf("Unable to retrieve USB devices\n");
+		return;
+	}
+	libusb_device *savedDevs[count+1];
+	modelInfo *savedModels[count+1];
+	int devI = 0;
+	for (ssize_t d = 0; d < count; d++){
+		struct libusb_device_descriptor devDesc;
+		if (libusb_get_device_descriptor(devs[d], &devDesc) < 0){
+			if (debug > 0){
+				printf("Unable to retrieve info from device #%zd. Ignoring...\n", d);
+			}
+		}else if (checkDevice(devDesc.idVendor, devDesc.idProduct) && keydialFind(devs[d]) == NULL){
+			savedDevs[devI] = devs[d];
+			savedModels[devI] = getDeviceModel(devDesc.idVendor, devDesc.idProduct);
+			devI++;
+		}
+	}
+
+	if (accept == 1){
+		for (int d = 0; d < devI; d++)
+			usbOpen(savedDevs[d], savedModels[d], debug);
+	}else if (keydials == NULL && devI > 0){
+		int in = lastDeviceFind(savedDevs, savedModels, devI);
+		if (in >= 0 && debug > 0)
+			printf("\nOpening the last used device\n");
+		while(in == -1){
+			char buf[64], port[32];
+			printf("\n");
+			for(int d=0; d < devI; d++){
+				usbDevicePath(savedDevs[d], port, sizeof(port));
+				printf("%d) %04x:%04x %s (Bus: %03d Device: %03d Port: %s)\n", d, savedModels[d]->vendorId, savedModels[d]->productId, savedModels[d]->name, libusb_get_bus_number(savedDevs[d]), libusb_get_device_address(savedDevs[d]), port);
+			}
+			printf("Select a device to use: ");
+			fflush(stdout);
+			if (!pickerRead(buf, sizeof(buf))){
+				if (loop.running)
+					printf("\nNo device selected. Exitting...\n");
+				loop.running = false;
+				break;
+			}
+			in = atoi(buf);
+			if (in >= devI || in < 0){
+				in=-1;
+			}else{
+				lastDeviceSave(savedDevs[in], savedModels[in]);
+			}
+		}
+		if (in >= 0)
+			usbOpen(savedDevs[in], savedModels[in], debug);
+	}
+	// Opened handles keep their own reference to the device
+	libusb_free_device_list(devs, 1);
+}
+
+bool loopAdd(int fd, uint32_t events, sourceHandler handler, void* data){
+	loopSource* src = NULL;
+	for (int i = 0; i < MAX_SOURCES && src == NULL; i++)
+		if (loop.sources[i].handler == NULL)
+			src = &loop.sources[i];
+	if (src == NULL){
+		printf("Too many file descriptors to watch\n");
+		return false;
+	}
+	struct epoll_event ev = {.events = events, .data.ptr = src};
+	if (epoll_ctl(loop.epoll, EPOLL_CTL_ADD, fd, &ev) < 0){
+		printf("Unable to watch file descriptor %d: %s\n", fd, strerror(errno));
+		return false;
+	}
+	src->fd = fd;
+	src->handler = handler;
+	src->data = data;
+	return true;
+}
+
+void loopRemove(int fd){
+	for (int i = 0; i < MAX_SOURCES; i++)
+		if (loop.sources[i].handler != NULL && loop.sources[i].fd == fd){
+			epoll_ctl(loop.epoll, EPOLL_CTL_DEL, fd, NULL);
+			loop.sources[i].handler = NULL;
+		}
+}
+
+void usbEvents(int fd, uint32_t events, void* data){
+	struct timeval zero = {0, 0};
+	libusb_handle_events_timeout_completed(loop.ctx, &zero, NULL);
+}
+
+uint32_t usbPollEvents(short events){
+	return (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+}
+
+void usbPollfdAdded(int fd, short events, void* data){
+	loopAdd(fd, usbPollEvents(events), usbEvents, NULL);
+}
+
+void usbPollfdRemoved(int fd, void* data){
+	loopRemove(fd);
+}
+
+void signalEvents(int fd, uint32_t events, void* data){
+	struct signalfd_siginfo info;
+	while (read(fd, &info, sizeof(info)) == sizeof(info)){
+		if (info.ssi_signo != SIGUSR1){
+			loop.running = false;
+		}else if (stats.enabled){
+			statsPrint(stdout);
+		}
+	}
+}
+
+// Blocked in every thread so they are only read through the signalfd
+void signalsBlock(sigset_t* set){
+	sigemptyset(set);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, set, NULL);
+}
+
+// Touches the stack so the pages are there (and locked) before packets arrive
+void prefaultStack(){
+	volatile unsigned char stack[PREFAULT_STACK];
+	for (size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+void* readerRun(void* data){
+	int debug = *(int*)data;
+	if (reader.cpu >= 0){
+		// The raw system call keeps the mask handling free of _GNU_SOURCE
+		unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+		mask[reader.cpu / (8 * sizeof(unsigned long))] |= 1UL << (reader.cpu % (8 * sizeof(unsigned long)));
+		if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+			printf("Unable to pin the USB reader to CPU %d: %s\n", reader.cpu, strerror(errno));
+		else if (debug >= 1)
+			printf("USB reader pinned to CPU %d\n", reader.cpu);
+	}
+	prefaultStack();
+
+	unsigned long allocations = allocationCount();
+	uint64_t one = 1;
+	while (!reader.stop){
+		struct timeval tv = {transfersMerging ? 0 : 1, transfersMerging ? 1000 : 0}; // Retry merged packets soon
+		libusb_handle_events_timeout_completed(loop.ctx, &tv, &reader.stop);
+		if (transfersMerging){
+			pthread_mutex_lock(&keydialsLock);
+			for (keydial* kd = keydials; kd; kd = kd->next)
+				if (kd->transport == &usbTransport)
+					transferFlush(&kd->ring);
+			pthread_mutex_unlock(&keydialsLock);
+		}
+		if (atomic_exchange(&reader.pending, false) && write(reader.wake, &one, sizeof(one)) < 0)
+			printf("Unable to wake the event loop\n");
+	}
+	reader.allocations = allocationCount() - allocations;
+	return NULL;
+}
+
+void readerEvents(int fd, uint32_t events, void* data){
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		printf("Unable to read the USB reader wakeup: %s\n", strerror(errno));
+	// The devices are processed once the handlers have run
+}
+
+bool readerStart(int debug){
+	static int readerDebug;
+	readerDebug = debug;
+	reader.stop = 0;
+	reader.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reader.wake < 0 || !loopAdd(reader.wake, EPOLLIN, readerEvents, NULL)){
+		printf("Unable to create the USB reader wakeup: %s\n", strerror(errno));
+		if (reader.wake >= 0)
+			close(reader.wake);
+		reader.wake = -1;
+		return false;
+	}
+	int err = pthread_create(&reader.thread, NULL, readerRun, &readerDebug);
+	if (err != 0){
+		printf("Unable to start the USB reader: %s\n", strerror(err));
+		loopRemove(reader.wake);
+		close(reader.wake);
+		reader.wake = -1;
+		return false;
+	}
+	reader.started = true;
+	if (reader.priority > 0){
+		struct sched_param param = {.sched_priority = reader.priority};
+		err = pthread_setschedparam(reader.thread, SCHED_FIFO, &param);
+		if (err != 0)
+			printf("Unable to give the USB reader real-time priority %d: %s\n", reader.priority, strerror(err));
+		else if (debug >= 1)
+			printf("USB reader running at SCHED_FIFO priority %d\n", reader.priority);
+	}
+	return true;
+}
+
+void readerStop(){
+	if (!reader.started)
+		return;
+	reader.stop = 1;
+	libusb_interrupt_event_handler(loop.ctx);
+	pthread_join(reader.thread, NULL);
+	reader.started = false;
+	loopRemove(reader.wake);
+	close(reader.wake);
+	reader.wake = -1;
+#ifdef COUNT_ALLOCATIONS
+	printf("Heap allocations in the USB reader: %lu\n", reader.allocations);
+#endif
+}
+
+// Locks the pages the driver has and will map, as they are touched
+void memoryLock(int debug){
+	int flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+	flags |= MCL_ONFAULT; // Thread stacks are not locked in whole
+#endif
+	if (mlockall(flags) < 0)
+		printf("Unable to lock memory: %s\n", strerror(errno));
+	else if (debug >= 1)
+		printf("Memory locked\n");
+	prefaultStack();
+}
+
+// Watches the file descriptors libusb waits on, so every device shares one epoll set
+bool usbStart(int debug){
+	if (reader.enabled){
+		usb.hotplug = hotplugRegister(loop.ctx, debug);
+		hotplugArrived = 1;
+		return readerStart(debug);
+	}
+
+	const struct libusb_pollfd** fds = libusb_get_pollfds(loop.ctx);
+	if (fds == NULL){
+		printf("Unable to get the libusb file descriptors\n");
+		return false;
+	}
+	for (int i = 0; fds[i]; i++)
+		loopAdd(fds[i]->fd, usbPollEvents(fds[i]->events), usbEvents, NULL);
+	libusb_free_pollfds(fds);
+	libusb_set_pollfd_notifiers(loop.ctx, usbPollfdAdded, usbPollfdRemoved, NULL);
+
+	usb.hotplug = hotplugRegister(loop.ctx, debug);
+	hotplugArrived = 1; // Open what is already plugged in
+	return true;
+}
+
+int usbUpdate(int accept, int debug){
+	char indi[] = "|/-\\";
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (hotplugArrived || (!usb.hotplug && elapsedUs(&usb.lastScan, &now) >= 1000000)){
+		bool waiting = keydials == NULL;
+		hotplugArrived = 0;
+		usb.lastScan = now;
+		scanDevices(accept, debug);
+		if (!loop.running) // Stopped at the picker
+			return 0;
+		if (keydials == NULL && usb.hotplug){
+			// Sleep until a supported device is plugged in
+			printf("\rWaiting for a device...");
+			fflush(stdout);
+		}else if (keydials == NULL){
+			printf("\rWaiting for a device %c", indi[usb.c]);
+			fflush(stdout);
+			usb.c = (usb.c + 1) % 4;
+		}else if (waiting)
+			usb.c = 0;
+	}
+
+	int timeout = usb.hotplug ? -1 : 1000; // Without hotplug, look for new devices every second
+	struct timeval tv;
+	if (!reader.enabled && libusb_get_next_timeout(loop.ctx, &tv) == 1){
+		int t = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		if (timeout < 0 || t < timeout)
+			timeout = t;
+	}
+	return timeout;
+}
+
+void usbStop(){
+	if (usb.hotplug)
+		hotplugDeregister(loop.ctx);
+	if (usb.retry >= 0)
+		close(usb.retry);
+	usb.retry = -1;
+	readerStop();
+	libusb_set_pollfd_notifiers(loop.ctx, NULL, NULL, NULL);
+}
+
+transport usbTransport = {"usb", usbStart, usbUpdate, usbClose, usbStop};
+
+transport synthTransport;
+
+synthDevice synthDevices[MAX_SYNTHETIC];
+int synthCount = 0;
+int synthActive = 0; // Synthetic devices that have not finished yet
+
+// Reconnects the synthetic devices and reloads the configs over and over, watching resident memory
+struct {
+	int cycles; // 0 when not soaking
+	int cycle;
+	long packets;
+	long baseline; // KiB resident once warmed up
+	long peak;
+	bool failed;
+} soak;
+
+// Parses model[,rate[,count[,wheel]]]
+bool synthAdd(char* spec){
+	char name[32];
+	synthDevice s = {.rate = 1000, .count = 100000, .wheel = 30};
+	int fields = sscanf(spec, "%31[^,],%d,%ld,%d", name, &s.rate, &s.count, &s.wheel);
+	for (int i = 0; fields >= 1 && i < array_size(models); i++)
+		if (strcasecmp(name, models[i].name) == 0)
+			s.model = &models[i];
+	if (s.model == NULL || s.rate < 0 || s.count <= 0 || s.wheel < 0 || s.wheel > 100){
+		printf("Invalid synthetic device: %s\n", spec);
+		return false;
+	}
+	if (synthCount == MAX_SYNTHETIC){
+		printf("Too many synthetic devices\n");
+		return false;
+	}
+	s.seed = synthCount + 1;
+	synthDevices[synthCount++] = s;
+	return true;
+}
+
+unsigned int synthRandom(synthDevice* s){
+	s->seed = s->seed * 1103515245 + 12345;
+	return s->seed >> 16;
+}
+
+// Presses are followed by a release; wheel ticks are not
+void synthPacket(synthDevice* s, unsigned char* data){
+	memset(data, 0, PACKET_SIZE);
+	if (s->release){
+		s->release = false;
+		return;
+	}
+	if (s->model->modell == KD100 && synthRandom(s) % 100 < s->wheel){
+		s->model->encode(synthRandom(s) % 2 ? 641 : 642, data);
+		return;
+	}
+	int keycode = -1;
+	while (keycode <= 0)
+		keycode = s->model->keycodes[synthRandom(s) % array_size(s->model->keycodes)];
+	s->model->encode(keycode, data);
+	s->release = true;
+}
+
+void synthEvents(int fd, uint32_t events, void* data){
+	keydial* kd = data;
+	synthDevice* s = kd->synth;
+	long due;
+	if (s->rate > 0){
+		uint64_t expirations;
+		struct timespec now;
+		if (read(fd, &expirations, sizeof(expirations)) < 0)
+			return;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		due = (long)(s->rate * (elapsedUs(&s->start, &now) / 1000000.0)) - s->sent;
+	}else{ // Fill the ring up, it is emptied before the loop waits again
+		due = PACKET_QUEUE - 1 - (kd->ring.head - kd->ring.tail + PACKET_QUEUE) % PACKET_QUEUE;
+	}
+	if (due > s->count - s->sent)
+		due = s->count - s->sent;
+	for (; due > 0; due--){
+		unsigned char packet[PACKET_SIZE];
+		synthPacket(s, packet);
+		transferPush(&kd->ring, packet, PACKET_SIZE);
+		s->sent++;
+	}
+	if (s->sent == s->count)
+		kd->ring.err = LIBUSB_ERROR_NO_DEVICE;
+}
+
+bool synthStart(int debug){
+	soak.cycle++;
+	for (int i = 0; i < synthCount; i++){
+		synthDevice* s = &synthDevices[i];
+		s->sent = 0;
+		s->release = false;
+		if (s->rate > 0){
+			long interval = 1000000000L / s->rate;
+			if (interval < 1000000)
+				interval = 1000000; // Several packets per wakeup above 1000/s
+			struct itimerspec timer = {{0, interval}, {0, interval}};
+			s->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (s->fd >= 0)
+				timerfd_settime(s->fd, 0, &timer, NULL);
+		}else
+			s->fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (s->fd < 0){
+			printf("Unable to create a synthetic device: %s\n", strerror(errno));
+			continue;
+		}
+
+		keydial* kd = calloc(1, sizeof(keydial));
+		kd->model = s->model;
+		transferInit(&kd->ring, s->model);
+		kd->synth = s;
+		kd->transport = &synthTransport;
+		if (!loopAdd(s->fd, EPOLLIN, synthEvents, kd)){
+			close(s->fd);
+			free(kd);
+			continue;
+		}
+		if (soak.cycles == 0 || debug >= 1)
+			printf("Synthetic %s: %ld packets at %d/s, %d%% wheel\n", s->model->name, s->count, s->rate, s->wheel);
+		clock_gettime(CLOCK_MONOTONIC, &s->start);
+		keydialAdd(kd, debug);
+		synthActive++;
+	}
+	return synthActive > 0;
+}
+
+// Resident memory in KiB
+long soakResident(){
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Every tenth of the way, the first one being the warm-up the rest is compared to
+void soakMeasure(){
+	int step = soak.cycles < 10 ? 1 : soak.cycles / 10;
+	if (soak.cycle % step != 0 && soak.cycle != soak.cycles)
+		return;
+	long resident = soakResident();
+	if (soak.baseline == 0)
+		soak.baseline = resident;
+	if (resident > soak.peak)
+		soak.peak = resident;
+	printf("Soak: cycle %d/%d, %ld packets, %ld KiB resident (%+ld KiB)\n", soak.cycle, soak.cycles, soak.packets, resident, resident - soak.baseline);
+}
+
+void soakCycle(int debug){
+	soakMeasure();
+	for (int i = 0; i < array_size(configSlots); i++){
+		char path[PATH_MAX];
+		if (configSlots[i].used && findConfigfile(configSlots[i].name, path, sizeof(path), true) && !configSlotReload(&configSlots[i], path, debug))
+			printf("Soak: unable to reload %s\n", path);
+	}
+	synthStart(debug);
+}
+
+int synthUpdate(int accept, int debug){
+	if (synthActive == 0 && soak.cycle < soak.cycles)
+		soakCycle(debug);
+	return -1;
+}
+
+void synthClose(keydial* kd, int debug){
+	synthDevice* s = kd->synth;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double seconds = elapsedUs(&s->start, &now) / 1000000.0;
+	if (soak.cycles == 0 || debug >= 1)
+		printf("Synthetic %s: %ld packets in %.3f s (%.0f packets/s) | Merged: %lu\n", s->model->name, s->sent, seconds, seconds > 0 ? s->sent / seconds : 0, kd->ring.merged);
+	soak.packets += s->sent;
+	loopRemove(s->fd);
+	close(s->fd);
+	if (--synthActive == 0 && soak.cycle >= soak.cycles)
+		loop.running = false; // Nothing else will send packets
+}
+
+void synthStop(){
+	if (soak.cycles == 0)
+		return;
+	soakMeasure();
+	soak.failed = soak.peak - soak.baseline > SOAK_TOLERANCE;
+	printf("Soak: %s, resident memory grew by %ld KiB at most\n", soak.failed ? "FAILED" : "passed", soak.peak - soak.baseline);
+}
+
+transport synthTransport = {"synthetic", synthStart, synthUpdate, synthClose, synthStop};
+transport replayTransport;
+
+// Feeds a capture made with -record back in as if the devices sent it
+struct {
+	char* path;
+	FILE* file;
+	bool fast; // Ignore the recorded timing
+	int fd; // timerfd, or an eventfd that is never read in fast mode
+	int debug;
+	captureRecord next; // Read ahead
+	unsigned char data[PACKET_SIZE];
+	bool pending; // next holds a record
+	keydial* devices[256]; // By capture device id
+	int active;
+	int64_t first; // Time of the first record
+	struct timespec start;
+	long packets;
+} replay = {.fd = -1};
+
+void replayRead(){
+	replay.pending = fread(&replay.next, sizeof(captureRecord), 1, replay.file) == 1;
+	if (!replay.pending)
+		return;
+	if (replay.next.length > PACKET_SIZE || replay.next.model >= array_size(models) || fread(replay.data, 1, replay.next.length, replay.file) != replay.next.length){
+		printf("Capture %s is damaged, stopping the replay\n", replay.path);
+		replay.pending = false;
+	}
+}
+
+keydial* replayDevice(captureRecord* rec){
+	keydial* kd = replay.devices[rec->device];
+	if (kd != NULL)
+		return kd;
+	kd = calloc(1, sizeof(keydial));
+	kd->model = &models[rec->model];
+	transferInit(&kd->ring, kd->model);
+	kd->transport = &replayTransport;
+	printf("Replaying a %s\n", kd->model->name);
+	keydialAdd(kd, replay.debug);
+	replay.devices[rec->device] = kd;
+	replay.active++;
+	return kd;
+}
+
+bool ringFull(transferRing* ring){
+	return ring->merging || (ring->head + 1) % PACKET_QUEUE == ring->tail;
+}
+
+void replayEvents(int fd, uint32_t events, void* data){
+	if (!replay.fast){
+		uint64_t expirations;
+		if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+			return;
+	}
+	while (replay.pending){
+		keydial* kd = replayDevice(&replay.next);
+		if (ringFull(&kd->ring)){ // Continues once the loop has emptied the ring
+			struct itimerspec soon = {{0, 0}, {0, 1}};
+			if (!replay.fast)
+				timerfd_settime(replay.fd, 0, &soon, NULL);
+			return;
+		}
+		if (!replay.fast){
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long due = (replay.next.time - replay.first) / 1000 - elapsedUs(&replay.start, &now);
+			if (due > 0){ // Sleep until the record is due
+				struct timespec at = replay.start;
+				int64_t offset = replay.next.time - replay.first + at.tv_nsec;
+				at.tv_sec += offset / 1000000000;
+				at.tv_nsec = offset % 1000000000;
+				struct itimerspec timer = {{0, 0}, at};
+				timerfd_settime(replay.fd, TFD_TIMER_ABSTIME, &timer, NULL);
+				return;
+			}
+		}
+		transferPush(&kd->ring, replay.data, replay.next.length);
+		replay.packets++;
+		replayRead();
+	}
+
+	// Nothing left, the devices disconnect once their packets are handled
+	loopRemove(replay.fd);
+	for (int i = 0; i < array_size(replay.devices); i++)
+		if (replay.devices[i])
+			replay.devices[i]->ring.err = LIBUSB_ERROR_NO_DEVICE;
+	if (replay.active == 0)
+		loop.running = false;
+}
+
+bool replayStart(int debug){
+	captureHeader header;
+	replay.debug = debug;
+	replay.file = fopen(replay.path, "rbe");
+	if (replay.file == NULL){
+		printf("Unable to read %s: %s\n", replay.path, strerror(errno));
+		return false;
+	}
+	if (fread(&header, sizeof(header), 1, replay.file) != 1 || memcmp(header.magic, CAPTURE_MAGIC, 4) || header.version != CAPTURE_VERSION){
+		printf("%s is not a capture\n", replay.path);
+		fclose(replay.file);
+		return false;
+	}
+	if (replay.fast)
+		replay.fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+	else
+		replay.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (replay.fd < 0 || !loopAdd(replay.fd, EPOLLIN, replayEvents, NULL)){
+		printf("Unable to replay %s\n", replay.path);
+		fclose(replay.file);
+		return false;
+	}
+	replayRead();
+	replay.first = replay.next.time;
+	clock_gettime(CLOCK_MONOTONIC, &replay.start);
+	if (!replay.fast){ // Start right away
+		struct itimerspec timer = {{0, 0}, replay.start};
+		timerfd_settime(replay.fd, TFD_TIMER_ABSTIME, &timer, NULL);
+	}
+	return true;
+}
+
+int replayUpdate(int accept, int debug){
+	return -1;
+}
+
+void replayClose(keydial* kd, int debug){
+	for (int i = 0; i < array_size(replay.devices); i++)
+		if (replay.devices[i] == kd)
+			replay.devices[i] = NULL;
+	if (--replay.active > 0)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double seconds = elapsedUs(&replay.start, &now) / 1000000.0;
+	printf("Replayed %ld packets in %.3f s (%.0f packets/s)\n", replay.packets, seconds, seconds > 0 ? replay.packets / seconds : 0);
+	loop.running = false;
+}
+
+void replayStop(){
+	if (replay.fd >= 0)
+		close(replay.fd);
+	replay.fd = -1;
+	if (replay.file)
+		fclose(replay.file);
+	replay.file = NULL;
+}
+
+transport replayTransport = {"replay", replayStart, replayUpdate, replayClose, replayStop};
+transport hidrawTransport;
+
+// Reads the reports the kernel HID driver exposes, leaving it attached to the device
+struct {
+	int inotify; // Watches the device directory for new nodes, -1 to poll instead
+	bool scan;
+	struct timespec lastScan;
+} hidraw = {.inotify = -1};
+
+// Model of a hidraw node, from the HID id in its uevent
+modelInfo* hidrawModel(char* name){
+	char path[PATH_MAX], line[256];
+	unsigned int bus, vendor, product;
+	modelInfo* model = NULL;
+	snprintf(path, sizeof(path), "%s/%s/device/uevent", HIDRAW_SYSFS, name);
+	FILE* f = fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+	while (model == NULL && fgets(line, sizeof(line), f))
+		if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3)
+			model = getDeviceModel(vendor, product);
+	fclose(f);
+	if (model == NULL)
+		return NULL;
+
+	// Only the interface with the endpoint libusb reads sends packets the decoders know
+	snprintf(path, sizeof(path), "%s/%s/device/../ep_%02x", HIDRAW_SYSFS, name, model->port);
+	if (access(path, F_OK) == 0)
+		return model;
+	snprintf(path, sizeof(path), "%s/%s/device/../bInterfaceNumber", HIDRAW_SYSFS, name);
+	return access(path, F_OK) == 0 ? NULL : model; // Not a USB interface, like devices made through /dev/uhid
+}
+
+keydial* hidrawFind(char* name){
+	for (keydial* kd = keydials; kd; kd = kd->next)
+		if (kd->transport == &hidrawTransport && strcmp(kd->hidraw.name, name) == 0)
+			return kd;
+	return NULL;
+}
+
+// Grabs the input devices the kernel made for the same HID device
+void hidrawGrab(keydial* kd, int debug){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s/device/input", HIDRAW_SYSFS, kd->hidraw.name);
+	DIR* inputs = opendir(path);
+	struct dirent* input;
+	while (inputs && (input = readdir(inputs)) != NULL){
+		if (strncmp(input->d_name, "input", 5) != 0)
+			continue;
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%s/%s", path, input->d_name);
+		DIR* events = opendir(dir);
+		struct dirent* event;
+		while (events && (event = readdir(events)) != NULL && kd->hidraw.grabCount < MAX_GRABS){
+			if (strncmp(event->d_name, "event", 5) != 0)
+				continue;
+			char node[PATH_MAX];
+			snprintf(node, sizeof(node), "%s/input/%s", HIDRAW_DEV, event->d_name);
+			int fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if (fd >= 0 && ioctl(fd, EVIOCGRAB, 1) == 0){
+				kd->hidraw.grabs[kd->hidraw.grabCount++] = fd;
+				if (debug >= 1)
+					printf("Grabbed %s\n", node);
+			}else{
+				if (debug >= 1)
+					printf("Unable to grab %s: %s\n", node, strerror(errno));
+				if (fd >= 0)
+					close(fd);
+			}
+		}
+		if (events)
+			closedir(events);
+	}
+	if (inputs)
+		closedir(inputs);
+}
+
+void hidrawEvents(int fd, uint32_t events, void* data){
+	keydial* kd = data;
+	unsigned char report[PACKET_SIZE];
+	ssize_t length;
+	while ((length = read(fd, report, sizeof(report))) > 0)
+		transferPush(&kd->ring, report, length);
+	if (length == 0 || (length < 0 && errno != EAGAIN && errno != EINTR) || events & (EPOLLHUP | EPOLLERR))
+		kd->ring.err = LIBUSB_ERROR_NO_DEVICE;
+}
+
+keydial* hidrawOpen(char* name, modelInfo* model, int debug){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", HIDRAW_DEV, name);
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0){
+		printf("\nUnable to open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (debug > 0)
+		printf("\nUsing: %04x:%04x (%s)\n", model->vendorId, model->productId, path);
+	printf("Starting driver for the %s...\n", model->name);
+
+	keydial* kd = calloc(1, sizeof(keydial));
+	kd->model = model;
+	transferInit(&kd->ring, model);
+	kd->transport = &hidrawTransport;
+	kd->hidraw.fd = fd;
+	snprintf(kd->hidraw.name, sizeof(kd->hidraw.name), "%s", name);
+	if (!loopAdd(fd, EPOLLIN, hidrawEvents, kd)){
+		close(fd);
+		free(kd);
+		return NULL;
+	}
+	hidrawGrab(kd, debug);
+	printf("Driver is running!\n");
+	keydialAdd(kd, debug);
+	return kd;
+}
+
+// Opens every supported device that is not open yet
+void hidrawScan(int debug){
+	DIR* dir = opendir(HIDRAW_SYSFS);
+	if (dir == NULL){
+		printf("Unable to list %s: %s\n", HIDRAW_SYSFS, strerror(errno));
+		return;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL){
+		if (strncmp(entry->d_name, "hidraw", 6) != 0 || strlen(entry->d_name) >= sizeof(((keydial*)0)->hidraw.name))
+			continue;
+		keydial* kd = hidrawFind(entry->d_name);
+		modelInfo* model;
+		if (kd != NULL && kd->hidraw.grabCount == 0)
+			hidrawGrab(kd, debug); // The input devices may show up after the hidraw node
+		else if (kd == NULL && (model = hidrawModel(entry->d_name)) != NULL)
+			hidrawOpen(entry->d_name, model, debug);
+	}
+	closedir(dir);
+}
+
+void hidrawNotify(int fd, uint32_t events, void* data){
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+	while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+		for (char* p = buffer; p < buffer + length; ){
+			struct inotify_event* ev = (struct inotify_event*)p;
+			if (ev->len > 0 && strncmp(ev->name, "hidraw", 6) == 0)
+				hidraw.scan = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+}
+
+bool hidrawStart(int debug){
+	// Permissions are often set by udev after the node is created
+	hidraw.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (hidraw.inotify >= 0 && (inotify_add_watch(hidraw.inotify, HIDRAW_DEV, IN_CREATE | IN_ATTRIB) < 0 || !loopAdd(hidraw.inotify, EPOLLIN, hidrawNotify, NULL))){
+		close(hidraw.inotify);
+		hidraw.inotify = -1;
+	}
+	if (hidraw.inotify < 0)
+		printf("Unable to watch %s, polling for devices instead\n", HIDRAW_DEV);
+	hidraw.scan = true;
+	return true;
+}
+
+int hidrawUpdate(int accept, int debug){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (hidraw.scan || (hidraw.inotify < 0 && elapsedUs(&hidraw.lastScan, &now) >= 1000000)){
+		hidraw.scan = false;
+		hidraw.lastScan = now;
+		hidrawScan(debug);
+		if (keydials == NULL){
+			printf("\rWaiting for a device...");
+			fflush(stdout);
+		}
+	}
+	return hidraw.inotify < 0 ? 1000 : -1;
+}
+
+void hidrawClose(keydial* kd, int debug){
+	loopRemove(kd->hidraw.fd);
+	close(kd->hidraw.fd);
+	for (int i = 0; i < kd->hidraw.grabCount; i++)
+		close(kd->hidraw.grabs[i]); // Ungrabs it
+	printf("Closing %s...\n", kd->model->name);
+}
+
+void hidrawStop(){
+	if (hidraw.inotify < 0)
+		return;
+	loopRemove(hidraw.inotify);
+	close(hidraw.inotify);
+	hidraw.inotify = -1;
+}
+
+transport hidrawTransport = {"hidraw", hidrawStart, hidrawUpdate, hidrawClose, hidrawStop};
+transport* deviceTransport = &usbTransport;
+
+// Creates a virtual device through /dev/uhid and sends it synthetic packets, to try the hidraw path without the hardware
+int uhidRun(synthDevice* s){
+	static unsigned char descriptor[] = {
+		0x06, 0x00, 0xff, // Usage Page (Vendor Defined)
+		0x09, 0x01, // Usage (1)
+		0xa1, 0x01, // Collection (Application)
+		0x15, 0x00, // Logical Minimum (0)
+		0x26, 0xff, 0x00, // Logical Maximum (255)
+		0x75, 0x08, // Report Size (8)
+		0x95, UHID_REPORT, // Report Count
+		0x09, 0x01, // Usage (1)
+		0x81, 0x02, // Input (Data, Variable, Absolute)
+		0xc0 // End Collection
+	};
+	int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0){
+		printf("Unable to open /dev/uhid: %s\n", strerror(errno));
+		return -7;
+	}
+
+	struct uhid_event ev = {.type = UHID_CREATE2};
+	snprintf((char*)ev.u.create2.name, sizeof(ev.u.create2.name), "Virtual %s", s->model->name);
+	memcpy(ev.u.create2.rd_data, descriptor, sizeof(descriptor));
+	ev.u.create2.rd_size = sizeof(descriptor);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = s->model->vendorId;
+	ev.u.create2.product = s->model->productId;
+	if (write(fd, &ev, sizeof(ev)) != sizeof(ev)){
+		printf("Unable to create the virtual %s: %s\n", s->model->name, strerror(errno));
+		close(fd);
+		return -7;
+	}
+
+	// Reports sent before the driver opens the hidraw node would be lost
+	printf("Virtual %s created, waiting for the driver to open it...\n", s->model->name);
+	while (read(fd, &ev, sizeof(ev)) > 0 && ev.type != UHID_OPEN)
+		;
+	printf("Sending %ld packets at %d/s, %d%% wheel\n", s->count, s->rate, s->wheel);
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	for (s->sent = 0; s->sent < s->count; s->sent++){
+		unsigned char packet[PACKET_SIZE];
+		if (s->rate > 0){
+			long offset = s->start.tv_nsec + s->sent * (1000000000L / s->rate);
+			struct timespec at = {s->start.tv_sec + offset / 1000000000L, offset % 1000000000L};
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+		}
+		synthPacket(s, packet);
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_INPUT2;
+		ev.u.input2.size = UHID_REPORT;
+		memcpy(ev.u.input2.data, packet, UHID_REPORT);
+		if (write(fd, &ev, sizeof(ev)) != sizeof(ev)){
+			printf("Unable to send a packet: %s\n", strerror(errno));
+			break;
+		}
+	}
+	printf("Sent %ld packets\n", s->sent);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	if (write(fd, &ev, sizeof(ev)) != sizeof(ev))
+		printf("Unable to remove the virtual %s: %s\n", s->model->name, strerror(errno));
+	close(fd);
+	return 0;
+}
+
+bool loopStart(libusb_context* ctx){
+	loop.ctx = ctx;
+	loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (loop.epoll < 0){
+		printf("Unable to create the event loop: %s\n", strerror(errno));
+		return false;
+	}
+
+	sigset_t set;
+	signalsBlock(&set);
+	loop.signals = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (loop.signals < 0 || !loopAdd(loop.signals, EPOLLIN, signalEvents, NULL))
+		printf("Unable to watch for signals: %s\n", strerror(errno));
+	loop.running = true;
+	return true;
+}
+
+void loopStop(){
+	if (loop.signals >= 0)
+		close(loop.signals);
+	loop.signals = -1;
+	memset(loop.sources, 0, sizeof(loop.sources));
+	close(loop.epoll);
+	loop.epoll = -1;
+}
+
+// Milliseconds the event loop may sleep for
+int loopTimeout(int timeout){
+	for (keydial* kd = keydials; kd; kd = kd->next){
+		int t = keydialTimeout(kd);
+		if (t >= 0 && (timeout < 0 || t < timeout))
+			timeout = t;
+	}
+	return timeout;
+}
+
+typedef struct controlClient {
+	int fd; // -1 when the entry is free
+	char line[CONTROL_LINE];
+	int length;
+} controlClient;
+
+// UNIX socket that scripts use to query and drive the running driver
+struct {
+	char* path;
+	int fd;
+	int debug;
+	controlClient clients[MAX_CLIENTS];
+} control = {.fd = -1};
+
+keydial* controlDevice(char* arg){
+	int index = arg ? atoi(arg) : 0;
+	keydial* kd = keydials;
+	for (int i = 0; kd && i < index; i++)
+		kd = kd->next;
+	return kd;
+}
+
+void controlWheel(FILE* out, int index, keydial* kd){
+	config* cfg = kd->active;
+	fprintf(out, "%d %s wheel %d/%d", index, kd->model->name, kd->wheelFunction, cfg->totalWheels);
+	if (cfg->totalWheels > 0)
+		fprintf(out, " %s|%s", cfg->wheelEvents[kd->wheelFunction].left.function, cfg->wheelEvents[kd->wheelFunction].right.function);
+	fprintf(out, " held");
+	for (int i = 0; i < kd->heldCount; i++)
+		fprintf(out, "%s%s", i ? "," : " ", kd->held[i].act->function);
+	fprintf(out, "%s\n", kd->heldCount ? "" : " -");
+}
+
+// Every reply ends with a line starting with "ok" or "error"
+void controlRequest(FILE* out, char* line){
+	char* args[3] = {NULL, NULL, NULL};
+	char* save = NULL;
+	char* command = strtok_r(line, " \t\r", &save);
+	for (int i = 0; i < 3 && command; i++)
+		args[i] = strtok_r(NULL, " \t\r", &save);
+	if (command == NULL){
+		fprintf(out, "error empty request\n");
+		return;
+	}
+
+	if (strcmp(command, "state") == 0){
+		int index = 0;
+		for (keydial* kd = keydials; kd; kd = kd->next)
+			controlWheel(out, index++, kd);
+		fprintf(out, "ok %d devices\n", index);
+	}else if (strcmp(command, "stats") == 0){
+		if (!stats.enabled){
+			fprintf(out, "error stats are off, start the driver with -stats\n");
+			return;
+		}
+		statsPrint(out);
+		fprintf(out, "ok\n");
+	}else if (strcmp(command, "wheel") == 0 || strcmp(command, "swap") == 0){
+		bool swap = strcmp(command, "swap") == 0;
+		char* device = swap ? args[0] : args[1];
+		keydial* kd = controlDevice(device);
+		if (kd == NULL || (!swap && args[0] == NULL)){
+			fprintf(out, "error usage: wheel <function> [device] | swap [device]\n");
+			return;
+		}
+		int function = swap ? kd->wheelFunction + 1 : atoi(args[0]);
+		if (swap && function >= kd->active->totalWheels)
+			function = 0;
+		if (function < 0 || function >= kd->active->totalWheels){
+			fprintf(out, "error no wheel function %d\n", function);
+			return;
+		}
+		wheelFlush(&kd->batch, kd->active, control.debug);
+		kd->wheelFunction = function;
+		controlWheel(out, device ? atoi(device) : 0, kd);
+		fprintf(out, "ok\n");
+	}else if (strcmp(command, "button") == 0){
+		keydial* kd = controlDevice(args[1]);
+		int k = args[0] ? atoi(args[0]) : -1;
+		if (kd == NULL || k < 0 || k >= kd->active->totalButtons){
+			fprintf(out, "error usage: button <button> [device]\n");
+			return;
+		}
+		// A tap: pressed and released right away
+		action* act = &kd->active->events[k].act;
+		injectBegin();
+		wheelFlush(&kd->batch, kd->active, control.debug);
+		keydialAction(kd, act, CONTROL_BUTTON, control.debug);
+		keydialLift(kd, CONTROL_BUTTON);
+		injectCommit();
+		fprintf(out, "ok %s\n", act->function ? act->function : "unset");
+	}else if (strcmp(command, "help") == 0){
+		fprintf(out, "state | stats | wheel <function> [device] | swap [device] | button <button> [device]\nok\n");
+	}else{
+		fprintf(out, "error unknown request %s\n", command);
+	}
+}
+
+void controlDisconnect(controlClient* client){
+	loopRemove(client->fd);
+	close(client->fd);
+	client->fd = -1;
+}
+
+void controlEvents(int fd, uint32_t events, void* data){
+	controlClient* client = data;
+	char buffer[CONTROL_LINE];
+	ssize_t length = read(fd, buffer, sizeof(buffer));
+	if (length <= 0){
+		if (length == 0 || (errno != EAGAIN && errno != EINTR))
+			controlDisconnect(client);
+		return;
+	}
+
+	for (ssize_t i = 0; i < length; i++){
+		if (buffer[i] != '\n'){
+			if (client->length < CONTROL_LINE - 1)
+				client->line[client->length++] = buffer[i];
+			continue;
+		}
+		char* reply = NULL;
+		size_t replyLength = 0;
+		FILE* out = open_memstream(&reply, &replyLength);
+		client->line[client->length] = '\0';
+		client->length = 0;
+		controlRequest(out, client->line);
+		fclose(out);
+		// Replies are small; a client that does not read them is dropped
+		bool sent = send(fd, reply, replyLength, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)replyLength;
+		free(reply);
+		if (!sent){
+			controlDisconnect(client);
+			return;
+		}
+	}
+}
+
+void controlAccept(int fd, uint32_t events, void* data){
+	int conn = accept(fd, NULL, NULL);
+	if (conn < 0)
+		return;
+	fcntl(conn, F_SETFL, O_NONBLOCK);
+	fcntl(conn, F_SETFD, FD_CLOEXEC);
+	for (int i = 0; i < MAX_CLIENTS; i++){
+		controlClient* client = &control.clients[i];
+		if (client->fd >= 0)
+			continue;
+		client->fd = conn;
+		client->length = 0;
+		if (!loopAdd(conn, EPOLLIN, controlEvents, client)){
+			close(conn);
+			client->fd = -1;
+		}
+		return;
+	}
+	close(conn); // Too many connections
+}
+
+bool controlStart(int debug){
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	control.debug = debug;
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		control.clients[i].fd = -1;
+	if (control.path == NULL)
+		return true;
+	if (strlen(control.path) >= sizeof(addr.sun_path)){
+		printf("Control socket path is too long: %s\n", control.path);
+		return false;
+	}
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", control.path);
+	unlink(control.path); // Left behind by a driver that did not exit cleanly
+
+	control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control.fd < 0 || bind(control.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(control.fd, MAX_CLIENTS) < 0 || !loopAdd(control.fd, EPOLLIN, controlAccept, NULL)){
+		printf("Unable to create the control socket %s: %s\n", control.path, strerror(errno));
+		if (control.fd >= 0)
+			close(control.fd);
+		control.fd = -1;
+		return false;
+	}
+	if (debug >= 1)
+		printf("Listening on %s\n", control.path);
+	return true;
+}
+
+void controlStop(){
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (control.clients[i].fd >= 0)
+			controlDisconnect(&control.clients[i]);
+	if (control.fd < 0)
+		return;
+	loopRemove(control.fd);
+	close(control.fd);
+	unlink(control.path);
+	control.fd = -1;
+}
+
+bool macroStart(int debug){
+	macros.debug = debug;
+	macros.count = 0;
+	macros.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (macros.timer < 0 || !loopAdd(macros.timer, EPOLLIN, macroEvents, NULL)){
+		printf("Unable to start the macro timer\n");
+		if (macros.timer >= 0)
+			close(macros.timer);
+		macros.timer = -1;
+		return false;
+	}
+	return true;
+}
+
+// Macros still playing are cut short
+void macroStop(){
+	while (macros.count > 0)
+		macroFinish(macros.count - 1);
+	if (macros.timer < 0)
+		return;
+	loopRemove(macros.timer);
+	close(macros.timer);
+	macros.timer = -1;
+}
+
+void GetDevice(int debug, int accept, int dry, libusb_context *ctx){
+
+	if (debug > 0){
+		if (debug > 2)
+			debug=2;
+		printf("Version 1.4.1\nDebug level: %d\n", debug);
+	}
+
+	if (!configSlotsLoad(debug)) {
+		configSlotsFree();
+		return;
+	}
+	startupMark("config");
+
+	// Not important
+	uid_t uid=getuid(); // Used to check if the driver was ran as root
+	buildKeycodeTables();
+	if (!executorStart(debug)){
+		configSlotsFree();
+		return;
+	}
+	if (!loopStart(ctx) || !deviceTransport->start(debug)){
+		if (loop.epoll >= 0)
+			loopStop();
+		executorStop();
+		configSlotsFree();
+		return;
+	}
+	watcherStart(debug);
+	controlStart(debug);
+	focusStart(debug);
+	macroStart(debug);
+	if (reader.enabled)
+		memoryLock(debug);
+	startupMark("event loop");
+	while (loop.running){
+		int timeout = deviceTransport->update(accept, debug);
+
+		struct epoll_event evs[MAX_SOURCES];
+		int ready = epoll_wait(loop.epoll, evs, MAX_SOURCES, loopTimeout(timeout));
+		if (ready < 0 && errno != EINTR){
+			printf("Event loop failed: %s\n", strerror(errno));
+			break;
+		}
+		for (int i = 0; i < ready; i++){
+			loopSource* src = evs[i].data.ptr;
+			if (src->handler != NULL)
+				src->handler(src->fd, evs[i].events, src->data);
+		}
+		x11Queued();
+
+		configSlotsUpdate();
+		keydial** kd = &keydials;
+		while (*kd){
+			keydialProcess(*kd, debug, dry);
+			if ((*kd)->ring.err == 0){
+				kd = &(*kd)->next;
+				continue;
+			}
+			keydial* done = *kd;
+			pthread_mutex_lock(&keydialsLock);
+			*kd = done->next;
+			pthread_mutex_unlock(&keydialsLock);
+			if (soak.cycles == 0 || debug >= 1)
+				printTransferError(done->ring.err, debug);
+			keydialClose(done, debug);
+		}
+	}
+	while (keydials){
+		keydial* done = keydials;
+		pthread_mutex_lock(&keydialsLock);
+		keydials = done->next;
+		pthread_mutex_unlock(&keydialsLock);
+		keydialClose(done, debug);
+	}
+	macroStop();
+	injectReleaseAll();
+	focusStop();
+	controlStop();
+	deviceTransport->stop();
+	loopStop();
+	executorStop();
+	watcherStop();
+	configSlotsFree();
+	if (stats.enabled)
+		statsPrint(stdout);
+}
+
+// Events of one packet are sent together, and the shadow table keeps a key from going down or up twice
+struct {
+	int depth; // Nested injectBegin calls, events are sent when the last one commits
+	unsigned char keys[KEY_CNT]; // Actions holding each key down, by X keycode or uinput code
+	unsigned char buttons[6]; // Same for mouse buttons
+	bool flush; // XTest requests waiting to be flushed
+	struct input_event keyboard[INJECT_EVENTS+1]; // Room for the closing EV_SYN
+	int keyboardCount;
+	struct input_event mouse[INJECT_EVENTS+1];
+	int mouseCount;
+} inject;
+
+// Counts presses, returns whether the event has to be sent
+bool injectPress(unsigned char* count, bool down){
+	if (down)
+		return *count < 255 && (*count)++ == 0;
+	return *count > 0 && --(*count) == 0;
+}
+
+void uinputQueue(struct input_event*, int*, unsigned short, unsigned short, int);
+void uinputCommit(int, struct input_event*, int);
+
+void injectWrite(){
+	if (inject.keyboardCount > 0)
+		uinputCommit(uinputKeyboard, inject.keyboard, inject.keyboardCount);
+	if (inject.mouseCount > 0)
+		uinputCommit(uinputMouse, inject.mouse, inject.mouseCount);
+	inject.keyboardCount = inject.mouseCount = 0;
+}
+
+void injectBegin(){
+	inject.depth++;
+}
+
+void injectCommit(){
+	if (--inject.depth > 0)
+		return;
+	if (inject.flush)
+		XFlush(display);
+	inject.flush = false;
+	injectWrite();
+}
+
+unsigned short uinputButton(int button){
+	unsigned short codes[] = {0, BTN_LEFT, BTN_MIDDLE, BTN_RIGHT};
+	return button > 0 && button < array_size(codes) ? codes[button] : 0;
+}
+
+// Lets go of whatever is still down, so nothing stays stuck after the driver exits
+void injectReleaseAll(){
+	injectBegin();
+	for (int code = 0; code < KEY_CNT; code++){
+		if (inject.keys[code] == 0)
+			continue;
+		inject.keys[code] = 0;
+		if (windowsystem == X11 && display){
+			XTestFakeKeyEvent(display, code, False, CurrentTime);
+			inject.flush = true;
+		}else if (windowsystem == WAYLAND && inject.keyboardCount < INJECT_EVENTS)
+			uinputQueue(inject.keyboard, &inject.keyboardCount, EV_KEY, code, 0);
+	}
+	for (int button = 1; button < array_size(inject.buttons); button++){
+		if (inject.buttons[button] == 0)
+			continue;
+		inject.buttons[button] = 0;
+		if (windowsystem == X11 && display){
+			XTestFakeButtonEvent(display, button, False, CurrentTime);
+			inject.flush = true;
+		}else if (windowsystem == WAYLAND && uinputButton(button))
+			uinputQueue(inject.mouse, &inject.mouseCount, EV_KEY, uinputButton(button), 0);
+	}
+	injectCommit();
+}
+
+void HandlerBackend(action* act, int type, int count){
+	injectBegin(); // Sent right away unless a whole packet is being collected
+	switch(windowsystem) {
+		case X11:
+			HandlerX11(act, type, count);
+			break;
+		case WAYLAND:
+			HandlerWayland(act, type, count);
+			break;
+		case MOCK:
+			mockEvents += count;
+			break;
+		default:
+			printf("Wayland or X11 not found.");
+			break;
+	}
+	injectCommit();
+}
+
+void Handler(action* act, int type){
+	HandlerBackend(act, type, 1);
+}
 
-int readConfigfile(event** events, wheel** wheelEvents, int debug) {
-	int button=-1, totalButtons=0, wheelType=0, leftWheels=0, rightWheels=0, totalWheels=0;
+// Taps a key chord count times in one injection
+void HandlerRepeat(action* act, int count){
+	HandlerBackend(act, -1, count);
+}
 
-	// Load config file
-	if (debug >= 1){
-		printf("Loading config...\n");
+int uinputCreate(char* name, int (*enable)(int)){
+	int fd = open(uinputPath, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0){
+		printf("Unable to open %s: %s\n", uinputPath, strerror(errno));
+		return -1;
 	}
 
-	char* data = malloc(512*sizeof(char)); // Data received from the config file and the USB
-	FILE *f;
-	if (strcmp(file, "default.cfg")){
-		f = fopen(file, "r");
-		if (f == NULL){
-			char* home = getpwuid(getuid())->pw_dir;
-			char* config = "/.config/KD100/";
-			char temp[strlen(home)+strlen(config)+strlen(file)+1];
-			for (int i = 0; i < strlen(home); i++)
-				temp[i] = home[i];
-			for (int i = 0; i < strlen(config); i++)
-				temp[i+strlen(home)] = config[i];
-			for (int i = 0; i < strlen(file); i++)
-				temp[i+strlen(home)+strlen(config)] = file[i];
-			temp[strlen(home)+strlen(config)+strlen(file)] = '\0';
-			f = fopen(temp, "r");
-			if (f == NULL){
-				printf("CONFIG FILE NOT FOUND\n");
-				return 0;
-			}
-		}
-	}else{
-		f = fopen(file, "r");
-		if (f == NULL){
-			char* home = getpwuid(getuid())->pw_dir;
-			file = "/.config/KD100/default.cfg";
-			char temp[strlen(file)+strlen(home)+1];
-			for (int i = 0; i < strlen(home); i++)
-				temp[i] = home[i];
-			for (int i = 0; i < strlen(file); i++)
-				temp[i+strlen(home)] = file[i];
-			temp[strlen(home) + strlen(file)] = '\0';
-
-			f = fopen(temp, "r");
-			if (f == NULL){
-				printf("DEFAULT CONFIGS ARE MISSING!\n");
-				printf("Please add default.cfg to %s/.config/KD100/ or specify a file to use with -c\n", home);
-				return 0;
-			}
-		}
+	if (enable(fd) < 0){
+		// Anything that is not a uinput node (a file or a pipe) just receives the raw events
+		if (errno == ENOTTY || errno == EINVAL)
+			return fd;
+		printf("Unable to set up %s: %s\n", name, strerror(errno));
+		close(fd);
+		return -1;
 	}
-	while (fscanf(f, "%[^\n] ", data) == 1){
-		for (int i = 0; i < strlen(data) && strlen(data)-6 > 0; i++){
-			if (strcmp(Substring(data, i, 5), "type:") == 0 && button != -1){
-				(*events)[button].type = atoi(Substring(data, i+6, strlen(data)-(i+6)));
-				break;
-			}else if (strcmp(Substring(data, i, 6), "Button") == 0){
-				button = atoi(Substring(data, i+7, strlen(data)-(i+7)));
-				if (button >= totalButtons){
-					totalButtons = button + 1;
-					*events = realloc(*events, (totalButtons) * sizeof(event));
-				}
-				break;
-			}else if (strcmp(Substring(data, i, 9), "function:") == 0 && button != -1){
-				if (!wheelType)
-					(*events)[button].function = Substring(data, i+10, strlen(data)-(i+10));
-				else if (wheelType == 1){
-					if (rightWheels != 0){
-						*wheelEvents = realloc(*wheelEvents, (rightWheels+1)*sizeof(wheel));
-						(*wheelEvents)[rightWheels].right = Substring(data, i+10, strlen(data)-(i+10));
-						(*wheelEvents)[rightWheels].left = "NULL";
-					}else{
-						(*wheelEvents)[0].right = Substring(data, i+10, strlen(data)-(i+10));
-						(*wheelEvents)[0].left = "NULL";
-					}
-					rightWheels++;
-				}else{
-					if (leftWheels < rightWheels)
-						(*wheelEvents)[leftWheels].left = Substring(data, i+10, strlen(data)-(i+10));
-					else{
-						*wheelEvents = realloc(*wheelEvents, (leftWheels+1)*sizeof(wheel));
-						(*wheelEvents)[leftWheels].left = Substring(data, i+10, strlen(data)-(i+10));
-						(*wheelEvents)[leftWheels].right = "NULL";
-					}
-					leftWheels++;
-				}
-				break;
-			}else if (strcmp(Substring(data, i, 6), "Wheel ") == 0){
-				wheelType++;
-			}
-		}
+
+	struct uinput_setup setup;
+	memset(&setup, 0, sizeof(setup));
+	setup.id.bustype = BUS_VIRTUAL;
+	setup.id.vendor = models[0].vendorId;
+	setup.id.product = models[0].productId;
+	strncpy(setup.name, name, UINPUT_MAX_NAME_SIZE-1);
+	if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0){
+		printf("Unable to create %s: %s\n", name, strerror(errno));
+		close(fd);
+		return -1;
 	}
+	return fd;
+}
 
-	if (rightWheels > leftWheels)
-		totalWheels = rightWheels;
-	else
-		totalWheels = leftWheels;
+int uinputEnableKeyboard(int fd){
+	if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0)
+		return -1;
+	for (int i = KEY_ESC; i <= KEY_MICMUTE; i++)
+		ioctl(fd, UI_SET_KEYBIT, i);
+	return 0;
+}
 
-	if (debug > 0){
-		for (int i = 0; i < totalButtons; i++)
-			printf("Button: %d | Type: %d | Function: %s\n", i, (*events)[i].type, (*events)[i].function);
-		printf("\n");
-		for (int i = 0; i < totalWheels; i++)
-			printf("Wheel Right: %s | Wheel Left: %s\n", (*wheelEvents)[i].right, (*wheelEvents)[i].left);
-		printf("\n");
-	}
-	free(data);
-	return totalWheels;
+int uinputEnableMouse(int fd){
+	if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0)
+		return -1;
+	ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+	ioctl(fd, UI_SET_KEYBIT, BTN_MIDDLE);
+	ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+	ioctl(fd, UI_SET_EVBIT, EV_REL);
+	ioctl(fd, UI_SET_RELBIT, REL_X);
+	ioctl(fd, UI_SET_RELBIT, REL_Y);
+	ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+	return 0;
 }
 
-bool checkDevice(int vendor, int product) {
-	for(int i = 0; i < array_size(models); i++) {
-		if (models[i].vendorId == vendor && models[i].productId == product) {
-			return true;
-		}
+bool uinputOpen(){
+	uinputKeyboard = uinputCreate("KD100 Virtual Keyboard", uinputEnableKeyboard);
+	if (uinputKeyboard < 0)
+		return false;
+	uinputMouse = uinputCreate("KD100 Virtual Mouse", uinputEnableMouse);
+	if (uinputMouse < 0){
+		close(uinputKeyboard);
+		uinputKeyboard = -1;
+		return false;
 	}
-	return false;
+	return true;
 }
 
-modelInfo getDeviceModel(int vendor, int product) {
-	for(int i = 0; i < array_size(models); i++) {
-		if (models[i].vendorId == vendor && models[i].productId == product) {
-			return models[i];
-		}
+void uinputClose(){
+	if (uinputKeyboard >= 0){
+		ioctl(uinputKeyboard, UI_DEV_DESTROY);
+		close(uinputKeyboard);
+	}
+	if (uinputMouse >= 0){
+		ioctl(uinputMouse, UI_DEV_DESTROY);
+		close(uinputMouse);
 	}
-	modelInfo res = {0x0, 0x0, 0x0};
-	return res;
+	uinputKeyboard = uinputMouse = -1;
 }
 
-libusb_device_handle* openDevice(int accept, int debug, libusb_context *ctx) {
-	struct libusb_config_descriptor *desc; // USB description (For claiming interfaces)
-	int err = 0;
-	int d=0;
-	int devI=0;
-	libusb_device **devs; // List of USB devices
-	libusb_device *dev; // Selected USB device
-	libusb_device *savedDevs[sizeof(devs)];
+const keysymMap* uinputKeysym(KeySym sym){
+	for (int m = 0; m < array_size(keysymTable); m++)
+		if (keysymTable[m].keysym == sym)
+			return &keysymTable[m];
+	return NULL;
+}
 
-	err = libusb_get_device_list(ctx, &devs);
-	if (err < 0){
-		printf("Unable to retrieve USB devices. Exitting...\n");
-		return NULL;
+void uinputResolveKeychord(keychord* keys){
+	keys->evcount = 0;
+	for (int i = 0; i < keys->count && keys->evcount < MAX_CHORD_KEYS; i++){
+		const keysymMap* map = uinputKeysym(keys->syms[i]);
+		if (map == NULL)
+			continue;
+		if (map->shift)
+			keys->evcodes[keys->evcount++] = KEY_LEFTSHIFT;
+		keys->evcodes[keys->evcount++] = map->code;
 	}
-	// Gets a list of devices and looks for ones that have the same vid and pid
-	libusb_device_handle *handle = NULL; // USB handle
-	while ((dev = devs[d++]) != NULL){
-		struct libusb_device_descriptor devDesc;
-		char info[200] = "";
-		err = libusb_get_device_descriptor(dev, &devDesc);
-		if (err < 0){
-			if (debug > 0){
-				printf("Unable to retrieve info from device #%d. Ignoring...\n", d);
-			}
-		}else if (checkDevice(devDesc.idVendor, devDesc.idProduct)) {
-			model = getDeviceModel(devDesc.idVendor, devDesc.idProduct);
-			if (accept == 1){
-				err=libusb_open(dev, &handle);
-				if (err < 0){
-					printf("\nUnable to open device. Error: %d\n", err);
-					handle=NULL;
-					if (err == LIBUSB_ERROR_ACCESS){
-						printf("Error: Permission denied\n");
-						return NULL;
-					}
-				}
-				if (debug > 0){
-					struct libusb_device_descriptor desc;
-					int ret = libusb_get_device_descriptor(dev, &desc);
-					libusb_device_handle *handle;
-					if (libusb_open(dev, &handle) == LIBUSB_SUCCESS) {
-						libusb_get_string_descriptor_ascii(handle, devDesc.iProduct, (unsigned char *) info, sizeof(info));
-
-						printf("\nUsing: %04x:%04x (Bus: %03d Device: %03d) Name: %s\n", devDesc.idVendor, devDesc.idProduct, libusb_get_bus_number(dev), libusb_get_device_address(dev), info);
+}
 
-						libusb_close(handle);
-					}
-				}
-				break;
-			}else{
-				savedDevs[devI] = dev;
-				devI++;
-			}
-		}
-	}
-	if (accept == 0){
-		int in=-1;
-		while(in == -1){
-			char buf[64];
-			printf("\n");
-			system("lsusb");
-			printf("\n");
-			for(d=0; d < devI; d++){
-				printf("%d) %04x:%04x (Bus: %03d Device: %03d)\n", d, models[0].vendorId, models[0].productId, libusb_get_bus_number(savedDevs[d]), libusb_get_device_address(savedDevs[d]));
-			}
-			printf("Select a device to use: ");
-			fflush(stdout);
-			fgets(buf, 10, stdin);
-			in = atoi(buf);
-			if (in >= devI || in < 0){
-				in=-1;
-			}
-		}
-		err=libusb_open(savedDevs[in], &handle);
-		if (err < 0){
-			printf("Unable to open device. Error: %d\n", err);
-			handle=NULL;
-			if (err == LIBUSB_ERROR_ACCESS){
-				printf("Error: Permission denied\n");
-				return NULL;
-			}
-		}
-	}
-	return handle;
+void uinputQueue(struct input_event* events, int* n, unsigned short type, unsigned short code, int value){
+	memset(&events[*n], 0, sizeof(struct input_event));
+	events[*n].type = type;
+	events[*n].code = code;
+	events[*n].value = value;
+	(*n)++;
 }
 
-bool printTransferError(int err, int debug) {
-	// Potential errors
-	if (err == LIBUSB_ERROR_TIMEOUT)
-		printf("\nTIMEDOUT\n");
-	if (err == LIBUSB_ERROR_PIPE)
-		printf("\nPIPE ERROR\n");
-	if (err == LIBUSB_ERROR_NO_DEVICE)
-		printf("\nDEVICE DISCONNECTED\n");
-	if (err == LIBUSB_ERROR_OVERFLOW)
-		printf("\nOVERFLOW ERROR\n");
-	if (err == LIBUSB_ERROR_INVALID_PARAM)
-		printf("\nINVALID PARAMETERS\n");
-	if (err == -1)
-		printf("\nDEVICE IS ALREADY IN USE\n");
-	if (err < 0){
-		if (debug >= 1){
-			printf("Unable to retrieve data: %d\n", err);
-		}
-		return true;
-	}
-	return false;
+// Ends the frame of an action, unless nothing was queued since the last one
+void uinputSync(struct input_event* events, int* n){
+	if (*n > 0 && events[*n-1].type != EV_SYN)
+		uinputQueue(events, n, EV_SYN, SYN_REPORT, 0);
 }
 
-void deviceKD100Process(libusb_device_handle *handle, int debug, int dry, event* events, wheel* wheelEvents, int totalWheels) {
-	int err=0, wheelFunction=0;
-	event prevEvent;
-	prevEvent.function = "";
-	prevEvent.type = 0;
-	while (err >=0){ // Listen for events
-		unsigned char data[40]; // Stores device input
-		int keycode = 0; // Keycode read from the device
-		err = libusb_interrupt_transfer(handle, model.port, data, sizeof(data), NULL, 0); // Get data
+void uinputCommit(int fd, struct input_event* events, int n){
+	// Everything collected for a packet is written in one call
+	uinputSync(events, &n);
+	if (write(fd, events, n * sizeof(struct input_event)) < 0)
+		printf("Unable to write to uinput: %s\n", strerror(errno));
+}
 
-		if (printTransferError(err, debug)) {
-			break;
-		}
+void HandlerWayland(action* act, int type, int count){
+	if (act->type != ACTION_KEY && act->type != ACTION_MOUSE)
+		return;
 
-		// Convert data to keycodes
-		if (data[4] != 0)
-			keycode = data[4];
-		else if (data[5] != 0)
-			keycode = data[5] + 128;
-		else if (data[6] != 0)
-			keycode = data[6] + 256;
-		if (data[1] == 241)
-			keycode+=512;
-		if (dry)
-			keycode = 0;
-
-		// Compare keycodes to data and trigger events
-		if (debug >= 1 && keycode != 0){
-			printf("Keycode: %d\n", keycode);
-		}
-		if (keycode == 0 && prevEvent.type != 0){ // Reset key held
-			Handler(prevEvent.function, prevEvent.type);
-			prevEvent.function = "";
-			prevEvent.type = 0;
-		}
-		if (keycode == 641){ // Wheel clockwise
-			Handler(wheelEvents[wheelFunction].right, -1);
-		}else if (keycode == 642){ // Counter clockwise
-			Handler(wheelEvents[wheelFunction].left, -1);
-		}else{
-			for (int k = 0; k < 19; k++){
-				if (model.keycodes[k] == keycode){
-					if (events[k].function){
-						if (strcmp(events[k].function, "NULL") == 0){
-							if (prevEvent.type != 0){
-								Handler(prevEvent.function, prevEvent.type);
-								prevEvent.type = 0;
-								prevEvent.function = "";
-							}
-							break;
-						}
-						if (events[k].type == 0){
-							if (strcmp(events[k].function, prevEvent.function)){
-								if (prevEvent.type != 0){
-									Handler(prevEvent.function, prevEvent.type);
-								}
-								prevEvent.function = events[k].function;
-								prevEvent.type=1;
-							}
-							Handler(events[k].function, 0);
-						}else if (strcmp(events[k].function, "swap") == 0){
-							if (wheelFunction != totalWheels-1){
-								wheelFunction++;
-							}else
-								wheelFunction=0;
-							if (debug >= 1){
-								printf("Function: %s | %s\n", wheelEvents[wheelFunction].left, wheelEvents[wheelFunction].right);
-							}
-						}else if (strcmp(events[k].function, "mouse1") == 0 || strcmp(events[k].function, "mouse2") == 0 || strcmp(events[k].function, "mouse3") == 0 || strcmp(events[k].function, "mouse4") == 0 || strcmp(events[k].function, "mouse5") == 0){
-							if (strcmp(events[k].function, prevEvent.function)){
-								if (prevEvent.type != 0){
-									Handler(prevEvent.function, prevEvent.type);
-								}
-								prevEvent.function = events[k].function;
-								prevEvent.type=3;
-							}
-							Handler(events[k].function, 2);
-						}else{
-							system(events[k].function);
-						}
-						break;
-					}
-				}
+	struct input_event* events = inject.keyboard;
+	int* n = &inject.keyboardCount;
+	if (type < 2){
+		keychord* keys = &act->keys;
+		if (keys->evcount == 0)
+			return;
+		if (type != -1)
+			count = 1;
+		else if (count > WHEEL_MAX_REPEAT)
+			count = WHEEL_MAX_REPEAT;
+		for (int r = 0; r < count; r++){
+			if (*n + 2*(MAX_CHORD_KEYS+1) + 2 > INJECT_EVENTS)
+				injectWrite();
+			if (type == 0 || type == -1){
+				for (int i = 0; i < keys->evcount; i++)
+					if (injectPress(&inject.keys[keys->evcodes[i]], true))
+						uinputQueue(events, n, EV_KEY, keys->evcodes[i], 1);
 			}
-		}
-
-		if(debug == 2 || dry){
-			printf("DATA: [%d", data[0]);
-			for (int i = 1; i < sizeof(data); i++){
-				printf(", %d", data[i]);
+			if (type == -1)
+				uinputSync(events, n);
+			if (type == 1 || type == -1){
+				for (int i = keys->evcount-1; i >= 0; i--)
+					if (injectPress(&inject.keys[keys->evcodes[i]], false))
+						uinputQueue(events, n, EV_KEY, keys->evcodes[i], 0);
 			}
-			printf("]\n");
+			uinputSync(events, n);
+		}
+	}else{
+		events = inject.mouse;
+		n = &inject.mouseCount;
+		if (*n + 2 > INJECT_EVENTS)
+			injectWrite();
+		// mouse4 and mouse5 are scroll up and down like in X11
+		if (uinputButton(act->button)){
+			if (injectPress(&inject.buttons[act->button], type == 2))
+				uinputQueue(events, n, EV_KEY, uinputButton(act->button), type == 2);
+		}else if (type == 2 && (act->button == 4 || act->button == 5)){
+			uinputQueue(events, n, EV_REL, REL_WHEEL, act->button == 4 ? 1 : -1);
 		}
+		uinputSync(events, n);
 	}
 }
 
-void deviceK20Process(libusb_device_handle *handle, int debug, int dry, event* events, wheel* wheelEvents, int totalWheels) {
-	int err=0, wheelFunction=0;
-	event prevEvent;
-	prevEvent.function = "";
-	prevEvent.type = 0;
-	while (err >=0){ // Listen for events
-		unsigned char data[40]; // Stores device input
-		int keycode = 0; // Keycode read from the device
-		err = libusb_interrupt_transfer(handle, model.port, data, sizeof(data), NULL, 0); // Get data
+void HandlerX11(action* act, int type, int count){
+	if (act->type != ACTION_KEY && act->type != ACTION_MOUSE)
+		return;
 
-		if (printTransferError(err, debug)) {
-			break;
-		}
+	if (xdotool)
+		HandlerXdotool(act, type, count);
+	else
+		HandlerXTest(act, type, count);
+}
 
-		// Convert data to keycodes
-		keycode = data[1];
-		if (keycode == 0) {
-			keycode = data[2];
-		}
+bool x11Open(){
+	int event, error, major, minor;
 
-		// Compare keycodes to data and trigger events
-		if (debug >= 1 && keycode != 0){
-			printf("Keycode: %d\n", keycode);
-		}
-		if (keycode == 0 && prevEvent.type != 0){ // Reset key held
-			Handler(prevEvent.function, prevEvent.type);
-			prevEvent.function = "";
-			prevEvent.type = 0;
-		}
-		if (keycode == 641){ // Wheel clockwise
-			Handler(wheelEvents[wheelFunction].right, -1);
-		}else if (keycode == 642){ // Counter clockwise
-			Handler(wheelEvents[wheelFunction].left, -1);
-		}else{
-			for (int k = 0; k < 19; k++){
-				if (model.keycodes[k] == keycode){
-					if (debug >= 2) {
-						printf("Key: %d Type: %d function: %s\n", k, events[k].type, events[k].function);
-					}
-					if (events[k].function){
-						if (strcmp(events[k].function, "NULL") == 0){
-							if (prevEvent.type != 0){
-								Handler(prevEvent.function, prevEvent.type);
-								prevEvent.type = 0;
-								prevEvent.function = "";
-							}
-							break;
-						}
-						if (events[k].type == 0){
-							if (strcmp(events[k].function, prevEvent.function)){
-								if (prevEvent.type != 0){
-									Handler(prevEvent.function, prevEvent.type);
-								}
-								prevEvent.function = events[k].function;
-								prevEvent.type=1;
-							}
-							Handler(events[k].function, 0);
-						}else if (strcmp(events[k].function, "swap") == 0){
-							if (wheelFunction != totalWheels-1){
-								wheelFunction++;
-							}else
-								wheelFunction=0;
-							if (debug >= 1){
-								printf("Function: %s | %s\n", wheelEvents[wheelFunction].left, wheelEvents[wheelFunction].right);
-							}
-						}else if (strcmp(events[k].function, "mouse1") == 0 || strcmp(events[k].function, "mouse2") == 0 || strcmp(events[k].function, "mouse3") == 0 || strcmp(events[k].function, "mouse4") == 0 || strcmp(events[k].function, "mouse5") == 0){
-							if (strcmp(events[k].function, prevEvent.function)){
-								if (prevEvent.type != 0){
-									Handler(prevEvent.function, prevEvent.type);
-								}
-								prevEvent.function = events[k].function;
-								prevEvent.type=3;
-							}
-							Handler(events[k].function, 2);
-						}else{
-							system(events[k].function);
-						}
-						break;
-					}
-				}
-			}
-		}
+	XInitThreads(); // Configs are compiled on the reload thread
+	display = XOpenDisplay(NULL);
+	if (display == NULL){
+		printf("Unable to open the X display\n");
+		return false;
+	}
+	if (!XTestQueryExtension(display, &event, &error, &major, &minor)){
+		printf("XTest extension is not available\n");
+		XCloseDisplay(display);
+		display = NULL;
+		return false;
+	}
+	return true;
+}
 
+XErrorHandler x11SavedHandler;
 
+// The focused window can be gone by the time it is asked about, other errors still go to the usual handler
+int x11IgnoreBadWindow(Display* d, XErrorEvent* error){
+	if (error->error_code == BadWindow)
+		return 0;
+	return x11SavedHandler(d, error);
+}
 
-		if(debug == 2 || dry){
-			printf("DATA: [%d", data[0]);
-			for (int i = 1; i < sizeof(data); i++){
-				printf(", %d", data[i]);
-			}
-			printf("]\n");
+void focusUpdate(Display* d){
+	Atom type;
+	int format;
+	unsigned long count, after;
+	unsigned char* data = NULL;
+	Window window = None;
+	XClassHint hint;
+
+	x11SavedHandler = XSetErrorHandler(x11IgnoreBadWindow);
+	if (XGetWindowProperty(d, DefaultRootWindow(d), focus.activeWindow, 0, 1, False, XA_WINDOW, &type, &format, &count, &after, &data) == Success && data){
+		if (count == 1 && format == 32)
+			window = *(Window*)data;
+		XFree(data);
+	}
+	focus.wmclass[0] = focus.wmname[0] = '\0';
+	if (window != None && XGetClassHint(d, window, &hint)){
+		snprintf(focus.wmclass, sizeof(focus.wmclass), "%s", hint.res_class ? hint.res_class : "");
+		snprintf(focus.wmname, sizeof(focus.wmname), "%s", hint.res_name ? hint.res_name : "");
+		XFree(hint.res_class);
+		XFree(hint.res_name);
+	}
+	XSetErrorHandler(x11SavedHandler);
+	focus.generation++;
+	if (focus.debug >= 1)
+		printf("Focused: %s (%s)\n", focus.wmclass, focus.wmname);
+}
+
+void x11HandleEvents(Display* d){
+	// Keyboard layout changes are announced to every client with MappingNotify
+	while (XPending(d)){
+		XEvent ev;
+		XNextEvent(d, &ev);
+		if (ev.type == MappingNotify && d == display){
+			XRefreshKeyboardMapping(&ev.xmapping);
+			keymapGeneration++;
+		}else if (ev.type == PropertyNotify && ev.xproperty.atom == focus.activeWindow){
+			focusUpdate(d);
 		}
 	}
+}
 
+// Keymap and focus changes both arrive on the X connection, which the event loop watches
+void x11Events(int fd, uint32_t events, void* data){
+	x11HandleEvents(focus.display);
 }
 
-void GetDevice(int debug, int accept, int dry, libusb_context *ctx){
-	event* events = malloc(19*sizeof(event)); // Stores key events and functions
-	wheel* wheelEvents = malloc(19*sizeof(wheel)); // Stores wheel functions
+// Xlib reads events into its queue while waiting for replies, those do not wake the event loop
+void x11Queued(){
+	if (focus.display && XEventsQueued(focus.display, QueuedAlready))
+		x11HandleEvents(focus.display);
+}
 
-	if (debug > 0){
-		if (debug > 2)
-			debug=2;
-		printf("Version 1.4.1\nDebug level: %d\n", debug);
+// Follows _NET_ACTIVE_WINDOW on the root window; the window manager updates it on every focus change
+// The connection is the one XTest uses when it is open, so keymap changes are read from the same source
+bool focusStart(int debug){
+	focus.debug = debug;
+	if (windowsystem != X11)
+		return false;
+	focus.display = display ? display : XOpenDisplay(NULL);
+	if (focus.display == NULL){
+		printf("Unable to open the X display, profiles are disabled\n");
+		return false;
 	}
+	focus.activeWindow = XInternAtom(focus.display, "_NET_ACTIVE_WINDOW", False);
+	XSelectInput(focus.display, DefaultRootWindow(focus.display), PropertyChangeMask);
+	if (!loopAdd(ConnectionNumber(focus.display), EPOLLIN, x11Events, NULL)){
+		focusStop();
+		return false;
+	}
+	focusUpdate(focus.display);
+	return true;
+}
 
-	int totalWheels = readConfigfile(&events, &wheelEvents, debug);
-	if (totalWheels == 0) {
+void focusStop(){
+	if (focus.display == NULL)
 		return;
-	}
+	loopRemove(ConnectionNumber(focus.display));
+	if (focus.display != display)
+		XCloseDisplay(focus.display);
+	focus.display = NULL;
+}
 
-	// Not important
-	int c=0; // Index of the loading character to display when waiting for a device
-	int err=0;
-	uid_t uid=getuid(); // Used to check if the driver was ran as root
-	char indi[] = "|/-\\";
-	while (err == 0 || err == LIBUSB_ERROR_NO_DEVICE){
-		libusb_device_handle *handle = openDevice(accept, debug, ctx);
+void x11ResolveKeychord(keychord* keys){
+	KeyCode shift = XKeysymToKeycode(display, XK_Shift_L);
+	bool shifted = false;
+	keys->xcount = 0;
+	for (int i = 0; i < keys->count; i++){
+		KeyCode code = XKeysymToKeycode(display, keys->syms[i]);
+		if (code == 0)
+			continue;
+		// Keysyms like plus or A sit on the shifted level and need Shift held, as xdotool does
+		if (!shifted && shift && XkbKeycodeToKeysym(display, code, 0, 0) != keys->syms[i] && XkbKeycodeToKeysym(display, code, 0, 1) == keys->syms[i]){
+			keys->codes[keys->xcount++] = shift;
+			shifted = true;
+		}
+		keys->codes[keys->xcount++] = code;
+	}
+	keys->generation = keymapGeneration;
+}
 
-		int interfaces=0;
-		if (handle == NULL){
-			printf("\rWaiting for a device %c", indi[c]);
-			fflush(stdout);
-			usleep(250000); // Buffer
-			c++;
-			if (c == 4){
-				c=0;
+void HandlerXTest(action* act, int type, int count){
+	if (type < 2){
+		keychord* keys = &act->keys;
+		if (keys->generation != keymapGeneration)
+			x11ResolveKeychord(keys);
+		if (type != -1)
+			count = 1;
+		for (int r = 0; r < count; r++){
+			if (type == 0 || type == -1){
+				for (int i = 0; i < keys->xcount; i++)
+					if (injectPress(&inject.keys[keys->codes[i]], true))
+						XTestFakeKeyEvent(display, keys->codes[i], True, CurrentTime);
 			}
-			err = LIBUSB_ERROR_NO_DEVICE;
-		}else{ // Claims the device and starts the driver
-			interfaces = 0;
-			printf("Starting driver...\n");
-
-			// Read device and claim interfaces
-			libusb_device *dev = libusb_get_device(handle);
-			struct libusb_config_descriptor *desc; // USB description (For claiming interfaces)
-			libusb_get_config_descriptor(dev, 0, &desc);
-			interfaces = desc->bNumInterfaces;
-			libusb_free_config_descriptor(desc);
-			libusb_set_auto_detach_kernel_driver(handle, 1);
-			if (debug >= 1)
-				printf("Claiming interfaces... \n");
-
-			for (int x = 0; x < interfaces; x++){
-				libusb_kernel_driver_active(handle, x);
-				int err = libusb_claim_interface(handle, x);
-				if (err != LIBUSB_SUCCESS && debug >= 1)
-					printf("Failed to claim interface %d\n", x);
+			if (type == 1 || type == -1){
+				for (int i = keys->xcount-1; i >= 0; i--)
+					if (injectPress(&inject.keys[keys->codes[i]], false))
+						XTestFakeKeyEvent(display, keys->codes[i], False, CurrentTime);
 			}
+		}
+	}else if (act->button < array_size(inject.buttons) && injectPress(&inject.buttons[act->button], type == 2)){
+		XTestFakeButtonEvent(display, act->button, type == 2, CurrentTime);
+	}
+	inject.flush = true; // Sent when the packet is done
+}
 
-			printf("Driver is running!\n");
-
-
-			switch(model.modell) {
-				case KD100:
-					deviceKD100Process(handle, debug, dry, events, wheelEvents, totalWheels);
-					break;
-				case K20:
-					deviceK20Process(handle, debug, dry, events, wheelEvents, totalWheels);
-					break;
-				default:
-					return;
-			}
+KeySym stringToKeysym(char* name){
+	// Modifier names accepted by xdotool
+	char* aliases[][2] = {
+		{"ctrl", "Control_L"},
+		{"control", "Control_L"},
+		{"shift", "Shift_L"},
+		{"alt", "Alt_L"},
+		{"super", "Super_L"},
+		{"meta", "Meta_L"}
+	};
+	for (int i = 0; i < array_size(aliases); i++)
+		if (strcasecmp(name, aliases[i][0]) == 0)
+			return XStringToKeysym(aliases[i][1]);
+	return XStringToKeysym(name);
+}
 
+void parseKeychord(keychord* keys, char* function){
+	char name[64];
+	int n = 0;
 
-			// Cleanup
-			for (int x = 0; x<interfaces; x++) {
-				if (debug >= 1){
-					printf("Releasing interface %d...\n", x);
-				}
-				libusb_release_interface(handle, x);
+	for (int i = 0; ; i++){
+		char c = function[i];
+		if (c == '+' || c == '\0'){
+			name[n] = '\0';
+			if (n > 0 && keys->count < MAX_CHORD_KEYS){
+				KeySym sym = stringToKeysym(name);
+				if (sym != NoSymbol)
+					keys->syms[keys->count++] = sym;
 			}
-			printf("Closing device...\n");
-			libusb_close(handle);
-			interfaces=0;
-			sleep(1); // Buffer to wait in case the device was disconnected
+			n = 0;
+			if (c == '\0')
+				break;
+		}else if (c != ' ' && c != '\t' && c != '\r' && n < sizeof(name)-1){
+			name[n++] = c;
 		}
 	}
-}
 
-void Handler(char* key, int type){
-	switch(windowsystem) {
-		case X11:
-			HandlerX11(key, type);
-			break;
-		case WAYLAND:
-			HandlerWayland(key, type);
-			break;
-		default:
-			printf("Wayland or X11 not found.");
-			break;
-	}
 }
 
-void HandlerWayland(char* key, int type){
-	printf("Not implemented yet...");
+// Looks xdotool up in PATH instead of running it
+bool xdotoolFound(){
+	char* path = getenv("PATH");
+	char dir[PATH_MAX];
+	while (path && *path){
+		size_t length = strcspn(path, ":");
+		if (length > 0 && length < sizeof(dir) - sizeof("/xdotool")){
+			snprintf(dir, sizeof(dir), "%.*s/xdotool", (int)length, path);
+			if (access(dir, X_OK) == 0)
+				return true;
+		}
+		path += length + (path[length] == ':');
+	}
+	printf("xdotool was not found in PATH\n");
+	return false;
 }
 
-void HandlerX11(char* key, int type){
-	if (strcmp(key, "NULL") == 0)
-		return;
-
+void HandlerXdotool(action* act, int type, int count){
+	char* key = act->function;
 	char* cmd = "";
 	char mouse = 'a';
+	char repeat[48];
 
 	if (type < 2){
 		if (type == 0)
 			cmd = "xdotool keydown ";
 		else if (type == 1)
 			cmd = "xdotool keyup ";	
-		else
+		else if (count > 1){
+			snprintf(repeat, sizeof(repeat), " xdotool key --repeat %d ", count);
+			cmd = repeat;
+		}else
 			cmd = " xdotool key ";		
 	}else{
 		if (type == 2)
@@ -645,36 +4574,44 @@ void HandlerX11(char* key, int type){
 	}	
 }
 
-char* Substring(char* in, int start, int end){
-	if (start > strlen(in) || end + start > strlen(in)){
-		return in;
-	}
-	char* out = malloc(end+1);
-	for (int i = 0; i < end; i++)
-		out[i] = in[i+start];
-	out[end] = '\0';
-	return out;
-}
 
 
 int main(int args, char *in[]){
+	clock_gettime(CLOCK_MONOTONIC, &startup.begin);
+	startup.last = startup.begin;
 	windowsystem = NONE;
 	int debug=0, accept=0, dry=0, err;
-
-	err = system("xdotool sleep 0.01");
-	if (err != 0){
-		printf("Exitting...\n");
-		return -9;
-	}
+	char* record = NULL;
+	char* traceTo = NULL;
+	bool uhid = false;
 
 	for (int arg = 1; arg < args; arg++){
 		if (strcmp(in[arg],"-h") == 0 || strcmp(in[arg],"--help") == 0){
 			printf("Usage: KD100 [option]...\n");
-			printf("\t-a\t\tAssume the first device that matches %04x:%04x is the Keydial\n", models[0].vendorId, models[0].productId);
+			printf("\t-a\t\tUse every supported device without asking which one is the Keydial\n");
 			printf("\t-c [path]\tSpecifies a config file to use\n");
+			printf("\t-cache\t\tKeep a compiled copy of the config in ~/.cache/KD100 for faster startup\n");
 			printf("\t-d [-d]\t\tEnable debug outputs (use twice to view data sent by the device)\n");
 			printf("\t-dry \t\tDisplay data sent by the device without sending events\n");
-			printf("\t-h\t\tDisplays this message\n\n");
+			printf("\t-fast\t\tReplay captures as fast as possible instead of at the recorded timing\n");
+			printf("\t-h\t\tDisplays this message\n");
+			printf("\t-hidraw\t\tRead every supported device through /dev/hidraw instead of claiming it with libusb\n");
+			printf("\t-lowlatency\tRead USB on a thread of its own and lock the driver in memory\n");
+			printf("\t-rt [priority]\tRun the USB reader with SCHED_FIFO priority (implies -lowlatency)\n");
+			printf("\t-cpu [n]\tPin the USB reader to a CPU (implies -lowlatency)\n");
+			printf("\t-mock\t\tCount events instead of sending them\n");
+			printf("\t-record [path]\tSave the packets read from the devices to a capture file\n");
+			printf("\t-soak [cycles]\tReconnect synthetic devices and reload the config, checking that memory stays flat (implies -mock)\n");
+			printf("\t-socket [path]\tAccept requests on a UNIX socket (send \"help\" for a list)\n");
+			printf("\t-replay [path]\tRead the packets from a capture file instead of USB devices\n");
+			printf("\t-startup\tPrint how long each startup step takes and exit once a device is running\n");
+			printf("\t-stats\t\tMeasure input latency and print it on SIGUSR1 and on exit\n");
+			printf("\t-synthetic [model[,rate[,count[,wheel%%]]]]\n\t\t\tRead generated packets instead of USB devices (rate 0 sends them as fast as possible)\n");
+			printf("\t-trace [name]\tWrite the packets to a shared memory ring instead of printing the debug output\n");
+			printf("\t-traceread [name]\tPrint the packets a driver started with -trace dispatches\n");
+			printf("\t-uhid [model[,rate[,count[,wheel%%]]]]\n\t\t\tCreate a virtual device through /dev/uhid and send it generated packets\n");
+			printf("\t-uinput [path]\tuinput device to create virtual devices with (Wayland)\n");
+			printf("\t-xdotool\tInject events through xdotool instead of XTest\n\n");
 			return 0;
 		}
 		if (strcmp(in[arg],"-d") == 0){
@@ -696,12 +4633,125 @@ int main(int args, char *in[]){
 				return -8;
 			}
 		}
+		if (strcmp(in[arg], "-cache") == 0){
+			useConfigCache = true;
+		}
+		if (strcmp(in[arg], "-startup") == 0){
+			startup.enabled = true;
+		}
+		if (strcmp(in[arg], "-stats") == 0){
+			stats.enabled = true;
+		}
+		if (strcmp(in[arg], "-mock") == 0){
+			windowsystem = MOCK;
+		}
+		if (strcmp(in[arg], "-record") == 0 || strcmp(in[arg], "-replay") == 0){
+			if (in[arg+1] == NULL){
+				printf("No capture file specified. Exiting...\n");
+				return -8;
+			}
+			if (strcmp(in[arg], "-record") == 0){
+				record = in[arg+1];
+			}else{
+				replay.path = in[arg+1];
+				deviceTransport = &replayTransport;
+			}
+			arg++;
+		}
+		if (strcmp(in[arg], "-fast") == 0){
+			replay.fast = true;
+		}
+		if (strcmp(in[arg], "-hidraw") == 0){
+			deviceTransport = &hidrawTransport;
+		}
+		if (strcmp(in[arg], "-lowlatency") == 0){
+			reader.enabled = true;
+		}
+		if (strcmp(in[arg], "-rt") == 0 || strcmp(in[arg], "-cpu") == 0){
+			if (in[arg+1] == NULL || atoi(in[arg+1]) < (strcmp(in[arg], "-rt") == 0 ? 1 : 0) || atoi(in[arg+1]) >= 1024){
+				printf("No %s specified. Exiting...\n", strcmp(in[arg], "-rt") == 0 ? "priority" : "CPU");
+				return -8;
+			}
+			if (strcmp(in[arg], "-rt") == 0)
+				reader.priority = atoi(in[arg+1]);
+			else
+				reader.cpu = atoi(in[arg+1]);
+			reader.enabled = true;
+			arg++;
+		}
+		if (strcmp(in[arg], "-soak") == 0){
+			if (in[arg+1] == NULL || atoi(in[arg+1]) < 1){
+				printf("No number of cycles specified. Exiting...\n");
+				return -8;
+			}
+			soak.cycles = atoi(in[arg+1]);
+			arg++;
+		}
+		if (strcmp(in[arg], "-socket") == 0){
+			if (in[arg+1] == NULL){
+				printf("No socket path specified. Exiting...\n");
+				return -8;
+			}
+			control.path = in[arg+1];
+			arg++;
+		}
+		if (strcmp(in[arg], "-synthetic") == 0){
+			if (in[arg+1] == NULL || !synthAdd(in[arg+1])){
+				printf("No synthetic device specified. Exiting...\n");
+				return -8;
+			}
+			deviceTransport = &synthTransport;
+			arg++;
+		}
+		if (strcmp(in[arg], "-trace") == 0 || strcmp(in[arg], "-traceread") == 0){
+			if (in[arg+1] == NULL){
+				printf("No trace name specified. Exiting...\n");
+				return -8;
+			}
+			if (strcmp(in[arg], "-traceread") == 0)
+				return traceRead(in[arg+1]);
+			traceTo = in[arg+1];
+			arg++;
+		}
+		if (strcmp(in[arg], "-uhid") == 0){
+			if (in[arg+1] == NULL || !synthAdd(in[arg+1])){
+				printf("No virtual device specified. Exiting...\n");
+				return -8;
+			}
+			uhid = true;
+			arg++;
+		}
 		if (strcmp(in[arg], "-wayland") == 0){
 			windowsystem = WAYLAND;
 		}
 		if (strcmp(in[arg], "-x11") == 0){
 			windowsystem = X11;
 		}
+		if (strcmp(in[arg], "-uinput") == 0){
+			if (in[arg+1]){
+				uinputPath = in[arg+1];
+				arg++;
+			}else{
+				printf("No uinput device specified. Exiting...\n");
+				return -8;
+			}
+		}
+		if (strcmp(in[arg], "-xdotool") == 0){
+			xdotool = true;
+		}
+	}
+
+	if (uhid)
+		return uhidRun(&synthDevices[synthCount-1]);
+
+	if (soak.cycles > 0){
+		// Millions of events must not reach a real display
+		windowsystem = MOCK;
+		if (deviceTransport != &synthTransport && !synthAdd("KD100,0,10000,30")){
+			printf("Exitting...\n");
+			return -8;
+		}
+		deviceTransport = &synthTransport;
 	}
 
 	if (windowsystem == NONE) {
@@ -709,6 +4759,33 @@ int main(int args, char *in[]){
 		return 1;
 	}
 
+	if (windowsystem == X11 && !xdotool && !x11Open()){
+		printf("Falling back to xdotool...\n");
+		xdotool = true;
+	}
+	if (windowsystem == X11 && xdotool && !xdotoolFound()){
+		printf("Exitting...\n");
+		return -9;
+	}
+	if (windowsystem == WAYLAND && !uinputOpen()){
+		printf("Exitting...\n");
+		return -7;
+	}
+	startupMark("backend");
+
+	// Before any thread is started, so none of them takes the signals the event loop reads
+	sigset_t signals;
+	signalsBlock(&signals);
+
+	if (record && !captureOpen(record)){
+		printf("Exitting...\n");
+		return -8;
+	}
+	if (traceTo && !traceOpen(traceTo)){
+		printf("Exitting...\n");
+		return -8;
+	}
+
 	libusb_context *ctx;
 	err = libusb_init(&ctx);
 	if (err < 0){
@@ -717,7 +4794,15 @@ int main(int args, char *in[]){
 	}
 	// Uncomment to enable libusb debug messages
 	// libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, 1);
+	startupMark("libusb");
 	GetDevice(debug, accept, dry, ctx);
+	captureClose();
+	traceClose();
 	libusb_exit(ctx);
-	return 0;
+	if (display)
+		XCloseDisplay(display);
+	uinputClose();
+	if (windowsystem == MOCK)
+		printf("Mock backend: %lu events\n", mockEvents);
+	return soak.failed ? -10 : 0;
 }
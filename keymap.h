@@ -0,0 +1,166 @@
+#pragma once
+
+#include <stdbool.h>
+#include <linux/input-event-codes.h>
+#include <X11/keysym.h>
+
+// Maps X keysyms used in config files to Linux input event codes for the uinput backend
+typedef struct keysymMap {
+	unsigned long keysym;
+	unsigned short code;
+	bool shift;
+} keysymMap;
+
+static const keysymMap keysymTable[] = {
+	{XK_a, KEY_A, false},
+	{XK_b, KEY_B, false},
+	{XK_c, KEY_C, false},
+	{XK_d, KEY_D, false},
+	{XK_e, KEY_E, false},
+	{XK_f, KEY_F, false},
+	{XK_g, KEY_G, false},
+	{XK_h, KEY_H, false},
+	{XK_i, KEY_I, false},
+	{XK_j, KEY_J, false},
+	{XK_k, KEY_K, false},
+	{XK_l, KEY_L, false},
+	{XK_m, KEY_M, false},
+	{XK_n, KEY_N, false},
+	{XK_o, KEY_O, false},
+	{XK_p, KEY_P, false},
+	{XK_q, KEY_Q, false},
+	{XK_r, KEY_R, false},
+	{XK_s, KEY_S, false},
+	{XK_t, KEY_T, false},
+	{XK_u, KEY_U, false},
+	{XK_v, KEY_V, false},
+	{XK_w, KEY_W, false},
+	{XK_x, KEY_X, false},
+	{XK_y, KEY_Y, false},
+	{XK_z, KEY_Z, false},
+	{XK_A, KEY_A, true},
+	{XK_B, KEY_B, true},
+	{XK_C, KEY_C, true},
+	{XK_D, KEY_D, true},
+	{XK_E, KEY_E, true},
+	{XK_F, KEY_F, true},
+	{XK_G, KEY_G, true},
+	{XK_H, KEY_H, true},
+	{XK_I, KEY_I, true},
+	{XK_J, KEY_J, true},
+	{XK_K, KEY_K, true},
+	{XK_L, KEY_L, true},
+	{XK_M, KEY_M, true},
+	{XK_N, KEY_N, true},
+	{XK_O, KEY_O, true},
+	{XK_P, KEY_P, true},
+	{XK_Q, KEY_Q, true},
+	{XK_R, KEY_R, true},
+	{XK_S, KEY_S, true},
+	{XK_T, KEY_T, true},
+	{XK_U, KEY_U, true},
+	{XK_V, KEY_V, true},
+	{XK_W, KEY_W, true},
+	{XK_X, KEY_X, true},
+	{XK_Y, KEY_Y, true},
+	{XK_Z, KEY_Z, true},
+	{XK_0, KEY_0, false},
+	{XK_1, KEY_1, false},
+	{XK_2, KEY_2, false},
+	{XK_3, KEY_3, false},
+	{XK_4, KEY_4, false},
+	{XK_5, KEY_5, false},
+	{XK_6, KEY_6, false},
+	{XK_7, KEY_7, false},
+	{XK_8, KEY_8, false},
+	{XK_9, KEY_9, false},
+	{XK_F1, KEY_F1, false},
+	{XK_F2, KEY_F2, false},
+	{XK_F3, KEY_F3, false},
+	{XK_F4, KEY_F4, false},
+	{XK_F5, KEY_F5, false},
+	{XK_F6, KEY_F6, false},
+	{XK_F7, KEY_F7, false},
+	{XK_F8, KEY_F8, false},
+	{XK_F9, KEY_F9, false},
+	{XK_F10, KEY_F10, false},
+	{XK_F11, KEY_F11, false},
+	{XK_F12, KEY_F12, false},
+	{XK_Control_L, KEY_LEFTCTRL, false},
+	{XK_Control_R, KEY_RIGHTCTRL, false},
+	{XK_Shift_L, KEY_LEFTSHIFT, false},
+	{XK_Shift_R, KEY_RIGHTSHIFT, false},
+	{XK_Alt_L, KEY_LEFTALT, false},
+	{XK_Alt_R, KEY_RIGHTALT, false},
+	{XK_Super_L, KEY_LEFTMETA, false},
+	{XK_Super_R, KEY_RIGHTMETA, false},
+	{XK_Meta_L, KEY_LEFTMETA, false},
+	{XK_Meta_R, KEY_RIGHTMETA, false},
+	{XK_Escape, KEY_ESC, false},
+	{XK_Return, KEY_ENTER, false},
+	{XK_Tab, KEY_TAB, false},
+	{XK_BackSpace, KEY_BACKSPACE, false},
+	{XK_space, KEY_SPACE, false},
+	{XK_Delete, KEY_DELETE, false},
+	{XK_Insert, KEY_INSERT, false},
+	{XK_Home, KEY_HOME, false},
+	{XK_End, KEY_END, false},
+	{XK_Prior, KEY_PAGEUP, false},
+	{XK_Next, KEY_PAGEDOWN, false},
+	{XK_Left, KEY_LEFT, false},
+	{XK_Right, KEY_RIGHT, false},
+	{XK_Up, KEY_UP, false},
+	{XK_Down, KEY_DOWN, false},
+	{XK_Print, KEY_SYSRQ, false},
+	{XK_Pause, KEY_PAUSE, false},
+	{XK_Menu, KEY_MENU, false},
+	{XK_Caps_Lock, KEY_CAPSLOCK, false},
+	{XK_minus, KEY_MINUS, false},
+	{XK_equal, KEY_EQUAL, false},
+	{XK_bracketleft, KEY_LEFTBRACE, false},
+	{XK_bracketright, KEY_RIGHTBRACE, false},
+	{XK_semicolon, KEY_SEMICOLON, false},
+	{XK_apostrophe, KEY_APOSTROPHE, false},
+	{XK_grave, KEY_GRAVE, false},
+	{XK_backslash, KEY_BACKSLASH, false},
+	{XK_comma, KEY_COMMA, false},
+	{XK_period, KEY_DOT, false},
+	{XK_slash, KEY_SLASH, false},
+	{XK_KP_0, KEY_KP0, false},
+	{XK_KP_1, KEY_KP1, false},
+	{XK_KP_2, KEY_KP2, false},
+	{XK_KP_3, KEY_KP3, false},
+	{XK_KP_4, KEY_KP4, false},
+	{XK_KP_5, KEY_KP5, false},
+	{XK_KP_6, KEY_KP6, false},
+	{XK_KP_7, KEY_KP7, false},
+	{XK_KP_8, KEY_KP8, false},
+	{XK_KP_9, KEY_KP9, false},
+	{XK_KP_Add, KEY_KPPLUS, false},
+	{XK_KP_Subtract, KEY_KPMINUS, false},
+	{XK_KP_Multiply, KEY_KPASTERISK, false},
+	{XK_KP_Divide, KEY_KPSLASH, false},
+	{XK_KP_Enter, KEY_KPENTER, false},
+	{XK_KP_Decimal, KEY_KPDOT, false},
+	{XK_plus, KEY_EQUAL, true},
+	{XK_underscore, KEY_MINUS, true},
+	{XK_braceleft, KEY_LEFTBRACE, true},
+	{XK_braceright, KEY_RIGHTBRACE, true},
+	{XK_colon, KEY_SEMICOLON, true},
+	{XK_quotedbl, KEY_APOSTROPHE, true},
+	{XK_asciitilde, KEY_GRAVE, true},
+	{XK_bar, KEY_BACKSLASH, true},
+	{XK_less, KEY_COMMA, true},
+	{XK_greater, KEY_DOT, true},
+	{XK_question, KEY_SLASH, true},
+	{XK_exclam, KEY_1, true},
+	{XK_at, KEY_2, true},
+	{XK_numbersign, KEY_3, true},
+	{XK_dollar, KEY_4, true},
+	{XK_percent, KEY_5, true},
+	{XK_asciicircum, KEY_6, true},
+	{XK_ampersand, KEY_7, true},
+	{XK_asterisk, KEY_8, true},
+	{XK_parenleft, KEY_9, true},
+	{XK_parenright, KEY_0, true},
+};